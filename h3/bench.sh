@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Strong and weak scaling benchmark of tema3, on synthetic images created in
+# memory (no file is read). Every run is repeated REPEAT times and the best
+# "filter time" printed by tema3 --time is kept. The results are written as
+# CSV on the standard output:
+#
+# mode,type,chain,processes,width,height,seconds,megapixels_per_second,speedup,efficiency
+#
+# strong: the size of the image is WIDTH x HEIGHT for every number of processes,
+#         speedup = P0 * t(P0) / t(P), efficiency = speedup / P
+# weak:   the image has HEIGHT lines per process,
+#         speedup = P / P0 * t(P0) / t(P), efficiency = t(P0) / t(P)
+#
+# where P0 is the first number of processes of PROCESSES (usually 1).
+#
+# All the settings can be changed from the environment (or from make bench).
+
+MPIRUN=${MPIRUN:-mpirun}
+PROCESSES=${PROCESSES:-"1 2 4"}
+WIDTH=${WIDTH:-4000}
+HEIGHT=${HEIGHT:-3000}
+TYPES=${TYPES:-"pgm pnm"}
+MODES=${MODES:-"strong weak"}
+REPEAT=${REPEAT:-3}
+OPTIONS=${OPTIONS:-""}
+CHAINS=${CHAINS:-"smooth;blur;sharpen;mean;emboss;blur smooth sharpen emboss mean;gauss:5 box:7"}
+
+run()
+{
+    local processes=$1 image=$2 chain=$3 best=""
+
+    for i in $(seq $REPEAT); do
+        time=$($MPIRUN -np $processes ./tema3 --time $OPTIONS $image /dev/null $chain | awk '/^filter time:/ { print $3 }')
+        if [ -z "$time" ]; then
+            echo "tema3 failed: -np $processes $image $chain" >&2
+            exit 1
+        fi
+        best=$(awk -v a="$time" -v b="$best" 'BEGIN { print (b == "" || a < b) ? a : b }')
+    done
+
+    echo $best
+}
+
+echo "mode,type,chain,processes,width,height,seconds,megapixels_per_second,speedup,efficiency"
+
+IFS=';' read -ra chain_list <<< "$CHAINS"
+for mode in $MODES; do
+    for type in $TYPES; do
+        for chain in "${chain_list[@]}"; do
+            base=""
+            first=""
+            for processes in $PROCESSES; do
+                height=$HEIGHT
+                [ $mode = weak ] && height=$((HEIGHT * processes))
+
+                seconds=$(run $processes synthetic:${WIDTH}x${height}:$type "$chain") || exit 1
+                [ -z "$base" ] && base=$seconds && first=$processes
+
+                awk -v mode=$mode -v type=$type -v chain="$chain" -v p=$processes -v w=$WIDTH -v h=$height \
+                    -v t=$seconds -v base=$base -v first=$first 'BEGIN {
+                        if (mode == "strong") { speedup = first * base / t; efficiency = speedup / p; }
+                        else { speedup = p / first * base / t; efficiency = base / t; }
+                        printf "%s,%s,%s,%d,%d,%d,%.6f,%.2f,%.3f,%.3f\n", mode, type, chain, p, w, h, t,
+                               w * h / t / 1e6, speedup, efficiency
+                    }'
+            done
+        done
+    done
+done
@@ -4,6 +4,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <complex.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /**
  *  Local constant values area
@@ -12,8 +27,85 @@
 #define PGM 5
 #define PNM 6
 #define DEFAULT_TAG 0
+#define CHUNK_TAG 1
+#define REPORT_TAG 2
 #define MASTER 0
 
+/**
+ *  Dynamic scheduling: the smallest chunk of lines given to a worker
+ **/ 
+#define MIN_CHUNK_LINES 16
+
+/**
+ *  Incremental mode: the changed pixels of the input are found in bands of 
+ *  DIRTY_BAND_LINES lines, each giving at most one dirty rectangle.
+ **/ 
+#define DIRTY_BAND_LINES 64
+
+/**
+ *  Service mode: the longest request read from a connection
+ **/ 
+#define MAX_REQUEST_BYTES (64 * 1024)
+#define MAX_ERROR_BYTES 256
+#define REQUEST_TIMEOUT_MS 5000
+
+/**
+ *  Compressed transport (--compress): the lines are compressed in blocks of
+ *  COMPRESSION_BLOCK_BYTES, every block with its own method.
+ **/ 
+#define COMPRESSION_BLOCK_BYTES (64 * 1024)
+#define BLOCK_RAW 0
+#define BLOCK_DELTA_RLE 1
+
+/**
+ *  Kinds of filters
+ **/ 
+#define FILTER_BUILTIN 0
+#define FILTER_DENSE 1
+#define FILTER_SEPARABLE 2
+#define FILTER_BOX 3
+#define FILTER_RANK 4
+#define FILTER_FFT 5
+#define MAX_KERNEL_SIZE 255
+
+/**
+ *  Histograms of the rank filters: a bin for every value and a coarse bin for
+ *  every 16 values, kept one after the other.
+ **/ 
+#define RANK_BINS 256
+#define RANK_COARSE_BINS 16
+#define RANK_HISTOGRAM (RANK_BINS + RANK_COARSE_BINS)
+
+/**
+ *  The dense kernels of at least FFT_KERNEL_SIZE x FFT_KERNEL_SIZE values and
+ *  the separable ones of at least FFT_SEPARABLE_SIZE are applied in the 
+ *  frequency domain (kind FILTER_FFT), in tiles of at most MAX_FFT_SIZE.
+ **/ 
+#define FFT_KERNEL_SIZE 7
+#define FFT_SEPARABLE_SIZE 51
+#define MAX_FFT_SIZE 1024
+
+/**
+ *  Tiled engine: the filters of a group are applied together on a tile, as
+ *  long as the sum of their radii (the halo of the group) is at most 
+ *  TEMPORAL_BLOCKING_RADIUS; a tile should fit in TILE_CACHE_BYTES.
+ **/ 
+#define TEMPORAL_BLOCKING_RADIUS 8
+#define TILE_CACHE_BYTES (256 * 1024)
+
+/**
+ *  Profiling (--profile): the phases timed on every process and the largest
+ *  number of groups of filters timed one by one (the others add to the last).
+ **/ 
+#define PHASE_READ 0
+#define PHASE_DISTRIBUTE 1
+#define PHASE_HALO_WAIT 2
+#define PHASE_FILTER 3
+#define PHASE_COLLECT 4
+#define PHASE_WRITE 5
+#define NUMBER_OF_PHASES 6
+#define MAX_PROFILED_GROUPS 32
+
 /**
  *  End constant values area 
  **/ 
@@ -46,16 +138,225 @@ typedef struct
      *  For PNM images
      **/ 
     pixel **color_image;
+    /**
+     *  An image read by read_image keeps its pixels in place, in the mapping
+     *  of the file; NULL for the images created by allocate_image.
+     **/ 
+    void *mapping;
+    size_t mapping_size;
 
 } Image;
 
-typedef struct 
+struct filter;
+
+/**
+ *  A vector kernel of the filters with an integer form: computes the bytes 
+ *  [position, end) of a line in blocks and returns the first byte left.
+ **/ 
+typedef int (*fixed_point_kernel)(unsigned char **lines, unsigned char *result_line, int position, int end, 
+                                  int step, int length, const struct filter *current_filter);
+
+typedef struct filter
 {
     char name[50];
     float values[3][3];
+    /**
+     *  The exact integer form of the filter: values = weights / divisor.
+     *  It is used by the fixed point kernels; a zero divisor means that the
+     *  filter has no integer form and only the float path can be used.
+     **/ 
+    short weights[3][3];
+    int divisor;
+    /**
+     *  User kernels of size x size (size odd), kept as size * size values.
+     *  The built-in filters have kind FILTER_BUILTIN and use only the fields above.
+     *  The separable kernels also keep the two vectors of the 1-D passes:
+     *  kernel[i][j] = column_vector[i] * row_vector[j].
+     **/ 
+    int kind;
+    int size;
+    float *kernel;
+    float *column_vector;
+    float *row_vector;
+    /**
+     *  The rank filters (kind FILTER_RANK) take the value found at percentile
+     *  percent of the sorted pixels of the size x size window: 50 for the 
+     *  median, 0 for the minimum and 100 for the maximum.
+     **/ 
+    float percentile;
+    /**
+     *  The vector kernels of the integer form, chosen once when the chain is
+     *  parsed: the widest one supported (NULL if none) for most of the line 
+     *  and a narrower one for the rest.
+     **/ 
+    fixed_point_kernel wide_kernel;
+    fixed_point_kernel narrow_kernel;
 
 } filter;
 
+/**
+ *  The files of the MPI-IO path: every process reads and writes its own lines,
+ *  at offset + line * line_bytes.
+ **/ 
+typedef struct
+{
+    MPI_File input;
+    MPI_File output;
+    MPI_Offset input_offset;
+    MPI_Offset output_offset;
+    MPI_Offset line_bytes;
+
+} parallel_files;
+
+/**
+ *  A rectangle of an image: the columns [x, x + width) of the lines [y, y + height)
+ **/ 
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+
+} rectangle;
+
+/**
+ *  The block of a process in the 2-D decomposition (--blocks): its place in
+ *  the Cartesian grid of the processes, its lines and columns of the image and
+ *  its neighbours. The buffers of a block keep halo columns only on the sides
+ *  where it has a neighbour, so the image edges are line ends as for a strip.
+ **/ 
+typedef struct
+{
+    MPI_Comm grid;
+    int dims[2];
+    int coords[2];
+    int low_line;
+    int high_line;
+    int low_column;
+    int high_column;
+    int left;
+    int right;
+    int width;
+    int up;
+    int down;
+    int west;
+    int east;
+
+} block_layout;
+
+/**
+ *  The options of a run, given before the images
+ **/ 
+typedef struct
+{
+    int number_of_threads;
+    int dynamic;
+    int mpiio;
+    int stream_lines;
+    int timing;
+    char *manifest;
+    int profiling;
+    int shared;
+    /**
+     *  --roi: only this rectangle of the image is filtered and written
+     **/ 
+    int has_region;
+    rectangle region;
+    /**
+     *  --incremental: the previous input and output of the same chain, and the
+     *  rectangles of the input changed since then (--dirty); if there are none
+     *  they are found by comparing the two inputs.
+     **/ 
+    char *previous_input;
+    char *previous_output;
+    int number_of_dirty;
+    rectangle *dirty;
+    /**
+     *  --serve: the path of the UNIX socket of the service
+     **/ 
+    char *socket_path;
+    int compress;
+    int blocks;
+
+} run_options;
+
+/**
+ *  The measures of a process for --profile. The traffic and the time spent in
+ *  MPI are counted by the wrappers of the MPI calls (see Profiling); the bytes
+ *  of a collective are counted once for every other process it reaches.
+ **/ 
+typedef struct
+{
+    int enabled;
+    double phase_time[NUMBER_OF_PHASES];
+    double group_time[MAX_PROFILED_GROUPS];
+    int number_of_groups;
+    char group_names[MAX_PROFILED_GROUPS][64];
+    double mpi_time;
+    long long messages_sent;
+    long long bytes_sent;
+    long long messages_received;
+    long long bytes_received;
+    long long file_bytes_read;
+    long long file_bytes_written;
+
+} profile;
+
+/**
+ *  The measures of the compressed transport of a process: the bytes of the
+ *  lines sent and the bytes really sent, the blocks sent compressed and raw
+ *  and the time spent to compress and decompress.
+ **/ 
+typedef struct
+{
+    int enabled;
+    long long raw_bytes;
+    long long sent_bytes;
+    long long compressed_blocks;
+    long long raw_blocks;
+    double time;
+
+} compression;
+
+/**
+ *  The transforms of the FFT kernels: tiles of rows x columns values (powers
+ *  of 2), the spectrum of the kernel for this size, and the twiddle factors 
+ *  and the bit reversed indices of the 1-D transforms of both sizes.
+ **/ 
+typedef struct
+{
+    int rows;
+    int columns;
+    double complex *kernel;
+    double complex *tile;
+    double complex *column;
+    double complex *row_twiddles;
+    double complex *column_twiddles;
+    int *row_order;
+    int *column_order;
+
+} fft_plan;
+
+/**
+ *  Memory used by the user kernels, allocated once for every stage of the
+ *  tiled engine: a line of floats for the separable ones, a line of sums
+ *  for the box ones and a histogram for every byte of a line for the rank
+ *  ones (NULL for the other filters). The rank filters also need to know the
+ *  number of lines of the image above and under the filtered line. The FFT
+ *  kernels keep their transforms, built for the first region they filter.
+ **/ 
+typedef struct
+{
+    float *line;
+    int *sums;
+    unsigned short *histograms;
+    int above;
+    int below;
+    fft_plan *fft;
+
+} scratch;
+
 /**
  *  End type definitions 
  **/ 
@@ -73,7 +374,13 @@ const filter smooth =
         { 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
         { 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
         { 1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0}
-    }
+    },
+    {
+        { 1, 1, 1},
+        { 1, 1, 1},
+        { 1, 1, 1}
+    },
+    9
 };
 
 const filter aproximative_gaussian_blur = 
@@ -83,7 +390,13 @@ const filter aproximative_gaussian_blur =
         { 1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
         { 2.0 / 16.0, 4.0 / 16.0, 2.0 / 16.0},
         { 1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0}
-    }
+    },
+    {
+        { 1, 2, 1},
+        { 2, 4, 2},
+        { 1, 2, 1}
+    },
+    16
 };
 
 const filter sharpen = 
@@ -93,7 +406,13 @@ const filter sharpen =
         { 0.0, -2.0 / 3.0, 0.0},
         { -2.0 / 3.0, 11.0 / 3.0, -2.0 / 3.0},
         { 0.0, -2.0 / 3.0, 0.0}
-    }
+    },
+    {
+        { 0, -2, 0},
+        { -2, 11, -2},
+        { 0, -2, 0}
+    },
+    3
 };
 
 const filter mean_removal = 
@@ -103,7 +422,13 @@ const filter mean_removal =
         { -1.0, -1.0, -1.0},
         { -1.0, 9.0, -1.0},
         { -1.0, -1.0, -1.0}
-    }
+    },
+    {
+        { -1, -1, -1},
+        { -1, 9, -1},
+        { -1, -1, -1}
+    },
+    1
 };
 
 const filter emboss =
@@ -113,7 +438,13 @@ const filter emboss =
         { 0.0, 1.0, 0.0},
         { 0.0, 0.0, 0.0},
         { 0.0, -1.0, 0.0}
-    }
+    },
+    {
+        { 0, 1, 0},
+        { 0, 0, 0},
+        { 0, -1, 0}
+    },
+    1
 };
 
 const filter default_filter = 
@@ -123,9 +454,25 @@ const filter default_filter =
         { 0.0, 0.0, 0.0},
         { 0.0, 1.0, 0.0},
         { 0.0, 0.0, 0.0}
-    }
+    },
+    {
+        { 0, 0, 0},
+        { 0, 1, 0},
+        { 0, 0, 0}
+    },
+    1
 };
 
+/**
+ *  The measures of this process; they are taken only while enabled is set.
+ **/ 
+profile profiling;
+
+/**
+ *  The compressed transport of this process, used only while enabled is set.
+ **/ 
+compression transport;
+
 /**
  * End external constant values area
  **/ 
@@ -152,589 +499,6658 @@ const filter get_filter_by_name(char *filter_name)
 /****************************************************************************************************/
 
 /**
- * @param: image_file_name
- * Function that reads the content of the image and aditional 
- * data from the indicated filename.
+ * @param: current_filter
  * 
- **/ 
-Image *read_image(char *image_file_name)
+ * The number of lines needed above and under a line to filter it.
+ **/
+int get_filter_radius(const filter *current_filter)
 {
-    FILE *fin = fopen(image_file_name, "rb");
-    
-    if(fin == NULL)
+    if (current_filter -> kind == FILTER_BUILTIN)
     {
-        printf("The file can't be opened!\n");
-        exit(1);
+        return 1;
     }
 
-    Image *image = (Image *) malloc (sizeof(Image));
-    unsigned char image_type[3];
-    unsigned char comment[45];
-    int width;
-    int height;
-    int max_val;
-    fscanf(fin, "%s\n", image_type);
-    if (strcmp(image_type, "P5") == 0)
-    {
-        image -> type = PGM;
-    } 
-    else
+    return current_filter -> size / 2;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: current_filter
+ * @param: values -> owned by the filter from now on (released on error)
+ * @param: count
+ * @param: error -> MAX_ERROR_BYTES for the reason of an error
+ * 
+ * Set the kernel of a user filter and classify it: a box if all the values are
+ * equal, separable if it has rank 1 (like a gaussian) and dense otherwise; the
+ * large dense kernels are applied in the frequency domain. Returns 0, or -1 for
+ * an invalid kernel.
+ **/
+int set_kernel(filter *current_filter, float *values, int count, char *error)
+{
+    int size = (int) sqrt(count);
+    if (count == 0 || size * size != count || size % 2 == 0 || size > MAX_KERNEL_SIZE)
     {
-        image -> type = PNM;
+        snprintf(error, MAX_ERROR_BYTES, "The kernel of the filter %s must have size * size values with size odd", 
+                 current_filter -> name);
+        free(values);
+        return -1;
     }
-    fscanf(fin, "%[^\n]%*c", comment);
-    fscanf(fin, "%d %d\n", &width, &height);
-    fscanf(fin, "%d\n", &max_val);
-    image -> width = width;
-    image -> height = height;
-    image -> max_val = max_val;
-    if (image -> type == PGM)
+
+    current_filter -> size = size;
+    current_filter -> kernel = values;
+    current_filter -> kind = FILTER_DENSE;
+
+    int box = 1;
+    int pivot = 0;
+    for (int i = 0; i < count; i++)
     {
-        /**
-         *  Read black - white pixels
-         **/ 
-        unsigned char **pgm_content = (unsigned char **) malloc (image -> height * sizeof(unsigned char *));
-        for (int line = 0; line < image -> height; ++line)
+        if (values[i] != values[0])
         {
-            pgm_content[line] = (unsigned char *) malloc(image -> width * sizeof(unsigned char));
+            box = 0;
         }
-        for (int line  = 0; line < image -> height; ++line)
+        if (fabs(values[i]) > fabs(values[pivot]))
         {
-            fread(pgm_content[line], sizeof(unsigned char), image -> width, fin);
+            pivot = i;
         }
-        image -> image = pgm_content;
-    } 
-    else 
+    }
+
+    if (box)
     {
-        /**
-         *  Read RGB pixels
-         **/ 
-        pixel **pnm_content = (pixel **) malloc (image -> height * sizeof(pixel *));
-        for (int line = 0; line < image -> height; ++line)
-        {
-            pnm_content[line] = (pixel *) malloc (image -> width * sizeof(pixel)); 
-        }
-        for (int line = 0; line < image -> height; ++line)
+        current_filter -> kind = FILTER_BOX;
+        return 0;
+    }
+
+    if (size >= FFT_KERNEL_SIZE)
+    {
+        current_filter -> kind = FILTER_FFT;
+    }
+
+    /**
+     *  Rank 1 check: every line must be the line of the pivot multiplied
+     *  by the value in the column of the pivot.
+     **/ 
+    int pivot_line = pivot / size;
+    int pivot_column = pivot % size;
+    float *column_vector = (float *) malloc(size * sizeof(float));
+    float *row_vector = (float *) malloc(size * sizeof(float));
+    for (int i = 0; i < size; i++)
+    {
+        column_vector[i] = values[i * size + pivot_column];
+        row_vector[i] = values[pivot_line * size + i] / values[pivot];
+    }
+
+    float tolerance = 1e-6 * fabs(values[pivot]);
+    for (int i = 0; i < size; i++)
+    {
+        for (int j = 0; j < size; j++)
         {
-            fread(pnm_content[line], sizeof(pixel), image -> width, fin);
+            if (fabs(values[i * size + j] - column_vector[i] * row_vector[j]) > tolerance)
+            {
+                free(column_vector);
+                free(row_vector);
+                return 0;
+            }
         }
-        image -> color_image = pnm_content;
-    
     }
 
-    fclose(fin);
-    return image;
+    current_filter -> kind = size >= FFT_SEPARABLE_SIZE ? FILTER_FFT : FILTER_SEPARABLE;
+    current_filter -> column_vector = column_vector;
+    current_filter -> row_vector = row_vector;
+    return 0;
 }
 
 /****************************************************************************************************/
 
 /**
- * @param: image
- * @param: output_file_name
- * Write the image in the file specified by name;
+ * @param: text
+ * @param: current_filter
+ * @param: error
  * 
- **/ 
-void write_image(Image *image, char *output_file_name)
+ * Parse the values of a user kernel: size * size numbers separated by commas
+ * or spaces (row by row), optionally followed by '/' and a divisor for all of them.
+ * Returns 0, or -1 for an invalid kernel.
+ **/
+int parse_kernel(char *text, filter *current_filter, char *error)
 {
-    FILE *fout = fopen(output_file_name, "wb");
-    if (fout == NULL)
+    int capacity = 16;
+    int count = 0;
+    float *values = (float *) malloc(capacity * sizeof(float));
+    float divisor = 1.0;
+    char *position = text;
+
+    while (*position != '\0')
     {
-        printf("The file can't be opened!\n");
-        exit(1);
+        if (*position == ',' || *position == ' ' || *position == '\t' || *position == '\n' || *position == '\r')
+        {
+            position++;
+            continue;
+        }
+
+        if (*position == '/')
+        {
+            divisor = strtof(position + 1, &position);
+            continue;
+        }
+
+        char *end;
+        float value = strtof(position, &end);
+        if (end == position)
+        {
+            snprintf(error, MAX_ERROR_BYTES, "Invalid value in the kernel of the filter %s", current_filter -> name);
+            free(values);
+            return -1;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            values = (float *) realloc(values, capacity * sizeof(float));
+        }
+        values[count++] = value;
+        position = end;
     }
-    unsigned char *image_type;
-    unsigned char width[5];
-    unsigned char height[5];
-    unsigned char max_val[5];
-    unsigned char delimiter = ' ';
-    unsigned char separator = '\n';
-    sprintf(width, "%d", image -> width);
-    sprintf(height, "%d", image -> height);
-    sprintf(max_val, "%d", image -> max_val);
 
-    if (image -> type == PGM)
-    {
-        image_type = "P5\n";
-    } 
-    else
+    for (int i = 0; i < count; i++)
     {
-        image_type = "P6\n";
+        values[i] /= divisor;
     }
-    
-    fwrite(image_type, sizeof(unsigned char), strlen(image_type), fout);
-    fwrite(width, sizeof(unsigned char), strlen(width), fout);
-    fwrite(&delimiter, sizeof(unsigned char), 1, fout);
-    fwrite(height, sizeof(unsigned char), strlen(height), fout);
-    fwrite(&separator, sizeof(unsigned char), 1, fout);
-    fwrite(max_val, sizeof(unsigned char), strlen(max_val), fout);
-    fwrite(&separator, sizeof(unsigned char), 1, fout);
-    if (image -> type == PGM)
-    {
-        for (int line = 0; line < image -> height; ++line)
-        {
-            fwrite(image -> image[line], sizeof(unsigned char), image -> width, fout);
-        }
-    } 
-    else
+
+    if (divisor == 0.0)
     {
-         for (int line = 0; line < image -> height; ++line)
-         {
-            fwrite(image -> color_image[line], sizeof(pixel), image -> width, fout);
-         }
+        count = 0;
     }
-    
-    fclose(fout);
-    printf("\t\nThe result image has been writen in the current folder: %s\n", output_file_name);
+
+    return set_kernel(current_filter, values, count, error);
 }
 
 /****************************************************************************************************/
 
 /**
- *  The following functions repesent the API that handles the processes reposnse
- *  and action to specific images, so basically the image processing parallel API.
+ * @param: specification
+ * @param: current_filter -> the filter built
+ * @param: error -> MAX_ERROR_BYTES for the reason of an error
  * 
- **/ 
+ * Build a filter from its command line specification:
+ *  - a built-in name: smooth, blur, sharpen, mean, emboss
+ *  - box:K -> K x K box (mean value) filter
+ *  - gauss:K[:sigma] -> K x K gaussian filter
+ *  - kernel:v1,v2,...[/divisor] -> K x K kernel given row by row
+ *  - file:path -> the same values as above, read from a file
+ *  - median:R, min:R, max:R, percentile:R:P -> rank filters of radius R
+ * 
+ * Returns 0, or -1 for an invalid specification; nothing is left allocated then.
+ **/
+int try_parse_filter(char *specification, filter *result, char *error)
+{
+    filter current_filter = {0};
+    strncpy(current_filter.name, specification, sizeof(current_filter.name) - 1);
 
-/**
- * @param: image
- * @param: destination
- * @param: start
- * @param: finish
- * 
- * Send unsing MPI a couple of lines from a image content to another process.
- * Mainly used by master to scatter the matrix butr also by any slave process 
- * that have to send the processed matrix back.
- * The function send all data about the image and make no assumption for the 
- * receiver.
- **/
-void send_image(Image *image, int destination, int start, int finish)
-{
-    int _height = finish - start;
-    MPI_Send(&(image -> type), 1, MPI_INT, destination, DEFAULT_TAG, MPI_COMM_WORLD);
-    MPI_Send(&(image -> width), 1, MPI_INT, destination, DEFAULT_TAG, MPI_COMM_WORLD);
-    MPI_Send(&(_height), 1, MPI_INT, destination, DEFAULT_TAG, MPI_COMM_WORLD);
-    MPI_Send(&(image -> max_val), 1, MPI_INT, destination, DEFAULT_TAG, MPI_COMM_WORLD);
-    if (image -> type == PGM)
+    if (strncmp(specification, "median:", 7) == 0 || strncmp(specification, "min:", 4) == 0 ||
+        strncmp(specification, "max:", 4) == 0 || strncmp(specification, "percentile:", 11) == 0)
     {
-        for (int line = start; line < finish; ++line)
+        char *start = strchr(specification, ':') + 1;
+        char *end;
+        int radius = (int) strtol(start, &end, 10);
+        int valid = end != start;
+        float percentile = specification[1] == 'e' ? 50 : specification[1] == 'i' ? 0 : 100;
+        if (specification[0] == 'p')
         {
-            MPI_Send(image -> image[line], image -> width, MPI_UNSIGNED_CHAR, destination, DEFAULT_TAG, MPI_COMM_WORLD);
+            start = end + 1;
+            valid = valid && *end == ':';
+            percentile = valid ? strtof(start, &end) : -1;
+            valid = valid && end != start;
         }
-    } 
-    else
-    {
-         for (int line = start; line < finish; ++line)
+        if (!valid || radius < 0 || 2 * radius + 1 > MAX_KERNEL_SIZE || *end != '\0' || percentile < 0 || percentile > 100)
         {
-            MPI_Send(image -> color_image[line], 3 * image -> width, MPI_UNSIGNED_CHAR, destination, DEFAULT_TAG, MPI_COMM_WORLD);
+            snprintf(error, MAX_ERROR_BYTES, "Invalid radius or percentile for the filter %s", specification);
+            return -1;
         }
-    }
-}
 
-/****************************************************************************************************/
+        current_filter.kind = FILTER_RANK;
+        current_filter.size = 2 * radius + 1;
+        current_filter.percentile = percentile;
 
-/**
- * @param: source
- * 
- * Function that receive an image from a specified source.
- * The function receives all the data previously send by the other function
- * and make no assumption for the sender.
- * He only receives a couple of lines send with the above function.
- **/ 
-Image *receive_image(int source)
-{
-    Image *image = (Image *) malloc(sizeof(Image));
-    MPI_Recv(&(image -> type), 1, MPI_INT, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    MPI_Recv(&(image -> width), 1, MPI_INT, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    MPI_Recv(&(image -> height), 1, MPI_INT, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    MPI_Recv(&(image -> max_val), 1, MPI_INT, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    
-    if (image -> type == PGM)
+        *result = current_filter;
+        return 0;
+    }
+
+    if (strncmp(specification, "box:", 4) == 0 || strncmp(specification, "gauss:", 6) == 0)
     {
-        unsigned char **content = (unsigned char **) malloc(image -> height * sizeof(unsigned char *));
-        for (int line  = 0; line < image -> height; ++line)
+        int gauss = specification[0] == 'g';
+        char *end;
+        int size = (int) strtol(strchr(specification, ':') + 1, &end, 10);
+        double sigma = *end == ':' ? strtod(end + 1, NULL) : 0.3 * ((size - 1) * 0.5 - 1) + 0.8;
+        if (size < 1 || size % 2 == 0 || size > MAX_KERNEL_SIZE || sigma <= 0)
         {
-            content[line] =  (unsigned char *) malloc (image -> width * sizeof(unsigned char));
+            snprintf(error, MAX_ERROR_BYTES, "Invalid size for the filter %s", specification);
+            return -1;
         }
-        
-        for (int line = 0; line < image -> height; ++line)
+
+        float *values = (float *) malloc((size_t) size * size * sizeof(float));
+        double sum = 0.0;
+        for (int i = 0; i < size * size; i++)
+        {
+            double distance_i = i / size - size / 2;
+            double distance_j = i % size - size / 2;
+            values[i] = gauss ? exp(-(distance_i * distance_i + distance_j * distance_j) / (2 * sigma * sigma)) : 1.0;
+            sum += values[i];
+        }
+        for (int i = 0; i < size * size; i++)
+        {
+            values[i] /= sum;
+        }
+        if (set_kernel(&current_filter, values, size * size, error) < 0)
         {
-            MPI_Recv(content[line], image -> width, MPI_UNSIGNED_CHAR, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            return -1;
         }
-        
-        image -> image = content;
 
-    } 
-    else
+        *result = current_filter;
+        return 0;
+    }
+
+    if (strncmp(specification, "kernel:", 7) == 0)
     {
-        pixel **rgb_content = (pixel **) malloc(image -> height * sizeof(pixel *));
-        for (int line = 0; line < image -> height; ++line)
+        if (parse_kernel(specification + 7, &current_filter, error) < 0)
         {
-            rgb_content[line] =  (pixel *) malloc(image -> width * sizeof(pixel));
+            return -1;
         }
 
-        for (int line = 0; line < image -> height; ++line)
+        *result = current_filter;
+        return 0;
+    }
+
+    if (strncmp(specification, "file:", 5) == 0)
+    {
+        FILE *fin = fopen(specification + 5, "rb");
+        if (fin == NULL)
+        {
+            snprintf(error, MAX_ERROR_BYTES, "The file of the filter %s can't be opened!", specification);
+            return -1;
+        }
+        fseek(fin, 0, SEEK_END);
+        long length = ftell(fin);
+        fseek(fin, 0, SEEK_SET);
+        char *text = (char *) malloc(length + 1);
+        text[fread(text, 1, length, fin)] = '\0';
+        fclose(fin);
+
+        int status = parse_kernel(text, &current_filter, error);
+        free(text);
+        if (status < 0)
         {
-            MPI_Recv(rgb_content[line], 3 * image -> width, MPI_UNSIGNED_CHAR, source, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);   
+            return -1;
         }
 
-        image -> color_image = rgb_content;
-        
+        *result = current_filter;
+        return 0;
     }
-    
-    return image;
+
+    *result = get_filter_by_name(specification);
+    return 0;
 }
 
 /****************************************************************************************************/
 
 /**
- *  @param: image
- *  @param: filter
- *  @param: start_line -> in interval 0 - end_line
- *  @param: end_line -> in interval 0 - height
+ * @param: specification
  * 
- *  Apply a specific filter on an image in a region delimited by on height 
- *  by start_line and end_line.
- *  It also ensure that there is no overflow or underflow during the matrix
- *  multiplication by clamping values to 0 for negative ones and to 255 
- *  for unsigned char values that goes above the max value.
+ * Build a filter from its command line specification (see try_parse_filter);
+ * an invalid one stops the program.
+ **/
+filter parse_filter(char *specification)
+{
+    filter current_filter;
+    char error[MAX_ERROR_BYTES];
+    if (try_parse_filter(specification, &current_filter, error) < 0)
+    {
+        printf("%s\n", error);
+        exit(1);
+    }
+
+    return current_filter;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: type
+ * @param: width
+ * @param: height
+ * @param: max_val
+ * 
+ * Allocate an empty (zero filled) image with the given header.
+ * All the lines are kept in a single contiguous block, so that a group of 
+ * lines can be sent with a single MPI call, and the line pointers point in it.
+ * Zero rows are important because they are used as padding at the
+ * top and bottom of the image when a strip has no neighbour there.
+ **/ 
+Image *allocate_image(int type, int width, int height, int max_val)
+{
+    Image *image = (Image *) malloc(sizeof(Image));
+    image -> type = type;
+    image -> width = width;
+    image -> height = height;
+    image -> max_val = max_val;
+    image -> image = NULL;
+    image -> color_image = NULL;
+    image -> mapping = NULL;
+    image -> mapping_size = 0;
+
+    /**
+     *  At least one line pointer is kept so that the block can be released
+     *  even for an empty strip.
+     **/ 
+    int lines = height > 0 ? height : 1;
+
+    if (type == PGM)
+    {
+        unsigned char *content = (unsigned char *) calloc((size_t) width * lines, sizeof(unsigned char));
+        image -> image = (unsigned char **) malloc(lines * sizeof(unsigned char *));
+        for (int line = 0; line < lines; ++line)
+        {
+            image -> image[line] = content + (size_t) line * width;
+        }
+    }
+    else
+    {
+        pixel *content = (pixel *) calloc((size_t) width * lines, sizeof(pixel));
+        image -> color_image = (pixel **) malloc(lines * sizeof(pixel *));
+        for (int line = 0; line < lines; ++line)
+        {
+            image -> color_image[line] = content + (size_t) line * width;
+        }
+    }
+
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image
+ * 
+ * Release the content of an image and the image itself.
+ **/ 
+void free_image(Image *image)
+{
+    if (image -> mapping != NULL)
+    {
+        munmap(image -> mapping, image -> mapping_size);
+    }
+    else if (image -> type == PGM)
+    {
+        free(image -> image[0]);
+    }
+    else
+    {
+        free(image -> color_image[0]);
+    }
+
+    free(image -> image);
+    free(image -> color_image);
+    free(image);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image
+ * @param: line
+ * 
+ * Return the address of a line, no matter the type of the image.
+ **/ 
+void *get_line(Image *image, int line)
+{
+    if (image -> type == PGM)
+    {
+        return image -> image[line];
+    }
+    
+    return image -> color_image[line];
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image
+ * @param: first_line
+ * @param: last_line
+ * @param: to_planar -> 1 for packed to planar, 0 for planar to packed
+ * 
+ * Convert the lines [first_line, last_line) of a PNM image, in place, between 
+ * the packed layout of the file (red, green, blue for every pixel) and the 
+ * planar layout used while filtering (all the reds, then all the greens and 
+ * all the blues of the line), where every channel is filtered as a PGM line
+ * and the neighbours of a byte are next to it. PGM images are not changed.
+ **/ 
+void convert_lines(Image *image, int first_line, int last_line, int to_planar)
+{
+    if (image -> type == PGM || first_line >= last_line)
+    {
+        return;
+    }
+
+    int width = image -> width;
+    unsigned char *copy = (unsigned char *) malloc(3 * width);
+
+    for (int line = first_line; line < last_line; line++)
+    {
+        unsigned char *content = (unsigned char *) image -> color_image[line];
+        memcpy(copy, content, 3 * width);
+
+        if (to_planar)
+        {
+            for (int column = 0; column < width; column++)
+            {
+                content[column] = copy[3 * column];
+                content[width + column] = copy[3 * column + 1];
+                content[2 * width + column] = copy[3 * column + 2];
+            }
+        }
+        else
+        {
+            for (int column = 0; column < width; column++)
+            {
+                content[3 * column] = copy[column];
+                content[3 * column + 1] = copy[width + column];
+                content[3 * column + 2] = copy[2 * width + column];
+            }
+        }
+    }
+
+    free(copy);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: data
+ * @param: size
+ * @param: position -> the current position in data, updated
+ * 
+ * Skip the white spaces and the comments (from # to the end of the line) 
+ * before a field of the header.
+ **/ 
+void skip_separators(const unsigned char *data, size_t size, size_t *position)
+{
+    while (*position < size)
+    {
+        if (data[*position] == '#')
+        {
+            while (*position < size && data[*position] != '\n')
+            {
+                (*position)++;
+            }
+        }
+        else if (data[*position] == ' ' || data[*position] == '\t' || data[*position] == '\n' || 
+                 data[*position] == '\r' || data[*position] == '\v' || data[*position] == '\f')
+        {
+            (*position)++;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: data
+ * @param: size
+ * @param: position -> the current position in data, updated
+ * 
+ * Read a decimal field of the header; returns -1 if there is no valid number.
+ **/ 
+int read_header_number(const unsigned char *data, size_t size, size_t *position)
+{
+    skip_separators(data, size, position);
+
+    long long value = -1;
+    while (*position < size && data[*position] >= '0' && data[*position] <= '9')
+    {
+        value = (value < 0 ? 0 : value) * 10 + (data[*position] - '0');
+        if (value > 0x7fffffff)
+        {
+            return -1;
+        }
+        (*position)++;
+    }
+
+    return (int) value;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: data -> the content of an image file
+ * @param: size
+ * @param: header -> type, width, height, max_val
+ * 
+ * @param: offset -> the offset of the first pixel
+ * 
+ * Check the netpbm header of a P5 (PGM) or P6 (PNM) image: the magic number,
+ * the width, the height and the max value separated by any white spaces and 
+ * comments, followed by exactly one white space. Returns NULL, or the reason
+ * why the image is invalid or truncated.
+ **/ 
+const char *check_header(const unsigned char *data, size_t size, int header[4], size_t *offset)
+{
+    size_t position = 2;
+
+    if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+    {
+        return "The image is not a P5 or P6 netpbm image!";
+    }
+
+    header[0] = data[1] == '5' ? PGM : PNM;
+    header[1] = read_header_number(data, size, &position);
+    header[2] = read_header_number(data, size, &position);
+    header[3] = read_header_number(data, size, &position);
+
+    if (header[1] <= 0 || header[2] <= 0 || header[3] <= 0 || header[3] > 255 || position >= size ||
+        (data[position] != ' ' && data[position] != '\t' && data[position] != '\r' && data[position] != '\n'))
+    {
+        return "The header of the image is invalid!";
+    }
+
+    /**
+     *  The single white space after the max value
+     **/ 
+    position++;
+
+    size_t line_bytes = (size_t) (header[0] == PGM ? 1 : 3) * header[1];
+    if (size - position < line_bytes * header[2])
+    {
+        return "The image is truncated!";
+    }
+
+    *offset = position;
+    return NULL;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: data
+ * @param: size
+ * @param: header
+ * 
+ * Parse the header of an image (see check_header); returns the offset of the
+ * first pixel, an invalid or truncated image stops the program.
+ **/ 
+size_t parse_header(const unsigned char *data, size_t size, int header[4])
+{
+    size_t offset;
+    const char *error = check_header(data, size, header, &offset);
+    if (error != NULL)
+    {
+        printf("%s\n", error);
+        exit(1);
+    }
+
+    return offset;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image_file_name
+ * @param: size -> the size of the file
+ * 
+ * @param: error -> the reason of an error
+ * 
+ * Map a file in memory, private and writable (copy on write), so the image can
+ * also be used as a destination without changing the file. Returns NULL if the
+ * file can't be opened or mapped.
+ **/ 
+unsigned char *try_map_file(char *image_file_name, size_t *size, const char **error)
+{
+    int fd = open(image_file_name, O_RDONLY);
+    struct stat file_status;
+
+    if (fd < 0 || fstat(fd, &file_status) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        *error = "The file can't be opened!";
+        return NULL;
+    }
+
+    *size = file_status.st_size;
+    unsigned char *data = (unsigned char *) mmap(NULL, *size > 0 ? *size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        *error = "The file can't be mapped!";
+        return NULL;
+    }
+
+    return data;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image_file_name
+ * @param: size -> the size of the file
+ * 
+ * Map a file in memory (see try_map_file); a file that can't be mapped stops the program.
+ **/ 
+unsigned char *map_file(char *image_file_name, size_t *size)
+{
+    const char *error;
+    unsigned char *data = try_map_file(image_file_name, size, &error);
+    if (data == NULL)
+    {
+        printf("%s\n", error);
+        exit(1);
+    }
+
+    return data;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image_file_name
+ * @param: header -> type, width, height, max_val
+ * 
+ * Read only the header of an image; returns the offset of the first pixel.
+ **/ 
+size_t read_header(char *image_file_name, int header[4])
+{
+    size_t size;
+    unsigned char *data = map_file(image_file_name, &size);
+    size_t offset = parse_header(data, size, header);
+    munmap(data, size > 0 ? size : 1);
+
+    return offset;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: specification -> WIDTHxHEIGHT:pgm or WIDTHxHEIGHT:pnm
+ * @param: header -> type, width, height, max_val
+ * 
+ * Parse the size and the type of a synthetic image; returns 0, or -1 if the
+ * specification is invalid.
+ **/ 
+int parse_synthetic(char *specification, int header[4])
+{
+    char type[4];
+
+    if (sscanf(specification, "%dx%d:%3s", &header[1], &header[2], type) != 3 || header[1] <= 0 || header[2] <= 0 ||
+        (strcmp(type, "pgm") != 0 && strcmp(type, "pnm") != 0))
+    {
+        return -1;
+    }
+
+    header[0] = strcmp(type, "pgm") == 0 ? PGM : PNM;
+    header[3] = 255;
+    return 0;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: specification -> WIDTHxHEIGHT:pgm or WIDTHxHEIGHT:pnm
+ * 
+ * Create a synthetic image in memory, for the benchmarks: a gradient with
+ * pseudo random noise, always the same for the same size.
+ **/ 
+Image *create_synthetic_image(char *specification)
+{
+    int header[4];
+
+    if (parse_synthetic(specification, header) < 0)
+    {
+        printf("Invalid synthetic image: %s (expected synthetic:WIDTHxHEIGHT:pgm or :pnm)\n", specification);
+        exit(1);
+    }
+
+    int width = header[1];
+    int height = header[2];
+    Image *image = allocate_image(header[0], width, height, 255);
+    int line_bytes = (image -> type == PGM ? 1 : 3) * width;
+    unsigned int state = 2463534242u;
+
+    for (int line = 0; line < height; line++)
+    {
+        unsigned char *content = (unsigned char *) get_line(image, line);
+        for (int position = 0; position < line_bytes; position++)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            content[position] = (unsigned char) ((line + position) / 4 + (state & 63));
+        }
+    }
+
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image_file_name
+ * Function that reads the content of the image and aditional 
+ * data from the indicated filename.
+ * 
+ * The file is mapped in memory and the lines of the image point directly 
+ * in the mapping, so the pixels are never copied. A name that starts with
+ * synthetic: creates a synthetic image instead (see create_synthetic_image).
+ **/ 
+Image *read_image(char *image_file_name)
+{
+    if (strncmp(image_file_name, "synthetic:", 10) == 0)
+    {
+        return create_synthetic_image(image_file_name + 10);
+    }
+
+    size_t size;
+    unsigned char *data = map_file(image_file_name, &size);
+    int header[4];
+    size_t offset = parse_header(data, size, header);
+
+    Image *image = (Image *) malloc(sizeof(Image));
+    image -> type = header[0];
+    image -> width = header[1];
+    image -> height = header[2];
+    image -> max_val = header[3];
+    image -> image = NULL;
+    image -> color_image = NULL;
+    image -> mapping = data;
+    image -> mapping_size = size;
+
+    size_t line_bytes = (size_t) (image -> type == PGM ? 1 : 3) * image -> width;
+    if (image -> type == PGM)
+    {
+        /**
+         *  Black - white pixels
+         **/ 
+        image -> image = (unsigned char **) malloc(image -> height * sizeof(unsigned char *));
+        for (int line = 0; line < image -> height; ++line)
+        {
+            image -> image[line] = data + offset + line * line_bytes;
+        }
+    } 
+    else 
+    {
+        /**
+         *  RGB pixels
+         **/ 
+        image -> color_image = (pixel **) malloc(image -> height * sizeof(pixel *));
+        for (int line = 0; line < image -> height; ++line)
+        {
+            image -> color_image[line] = (pixel *) (data + offset + line * line_bytes);
+        }
+    }
+
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: header -> type, width, height, max_val
+ * @param: text -> at least 64 bytes
+ * 
+ * Format the header of an output image; returns its length.
+ **/
+int format_header(int header[4], char *text)
+{
+    return sprintf(text, "%s\n%d %d\n%d\n", header[0] == PGM ? "P5" : "P6", header[1], header[2], header[3]);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image
+ * @param: output_file_name
+ * Write the image in the file specified by name;
+ * 
+ * The lines of an image are contiguous (in the block of allocate_image or in
+ * the mapping of read_image), so the header and the pixels are written with a
+ * single writev.
+ **/ 
+void write_image(Image *image, char *output_file_name)
+{
+    int fd = open(output_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("The file can't be opened!\n");
+        exit(1);
+    }
+
+    char text[64];
+    int header[4] = {image -> type, image -> width, image -> height, image -> max_val};
+    struct iovec parts[2];
+    parts[0].iov_base = text;
+    parts[0].iov_len = format_header(header, text);
+    parts[1].iov_base = get_line(image, 0);
+    parts[1].iov_len = (size_t) (image -> type == PGM ? 1 : 3) * image -> width * image -> height;
+
+    /**
+     *  writev may write less than asked, so it is repeated for the rest.
+     **/ 
+    int first = 0;
+    while (first < 2)
+    {
+        ssize_t written = writev(fd, parts + first, 2 - first);
+        if (written < 0)
+        {
+            printf("The file can't be written!\n");
+            exit(1);
+        }
+
+        while (first < 2 && (size_t) written >= parts[first].iov_len)
+        {
+            written -= parts[first].iov_len;
+            first++;
+        }
+        if (first < 2)
+        {
+            parts[first].iov_base = (char *) parts[first].iov_base + written;
+            parts[first].iov_len -= written;
+        }
+    }
+    
+    close(fd);
+    printf("\t\nThe result image has been writen in the current folder: %s\n", output_file_name);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Profiling (--profile). Every process adds the wall time of its phases and 
+ *  of every group of filters to its own measures, and the wrappers below count
+ *  the messages, the bytes and the time of every MPI call made by the program 
+ *  (through PMPI, so the call sites do not change). At the end the master 
+ *  gathers the measures of all the processes and prints them as CSV. Building
+ *  with -DNO_MPI_PROFILE leaves out the wrappers: the phases are still timed.
+ **/ 
+
+/**
+ *  Returns the current time if the measures are taken, 0 otherwise.
+ **/
+double profile_clock(void)
+{
+    return profiling.enabled ? MPI_Wtime() : 0.0;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: phase -> one of PHASE_*
+ *  @param: start -> the value of profile_clock at the start of the phase
+ **/
+void profile_phase(int phase, double start)
+{
+    if (profiling.enabled)
+    {
+        profiling.phase_time[phase] += MPI_Wtime() - start;
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: group -> the index of the group of filters in the chain
+ *  @param: start -> the value of profile_clock before the group was applied
+ * 
+ *  The time of a group is also the time of the filter phase.
+ **/
+void profile_group(int group, double start)
+{
+    if (profiling.enabled)
+    {
+        double time = MPI_Wtime() - start;
+        profiling.group_time[(int)fmin(group, MAX_PROFILED_GROUPS - 1)] += time;
+        profiling.phase_time[PHASE_FILTER] += time;
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: specifications -> the filters of the chain, as given in the command line
+ *  @param: group_start -> the first filter of every group, number_of_groups + 1 values
+ *  @param: number_of_groups
+ * 
+ *  Keep the names of the groups for the summary; in batch mode the groups of 
+ *  the same index of all the images are added together.
+ **/
+void profile_groups(char **specifications, int *group_start, int number_of_groups)
+{
+    if (!profiling.enabled)
+    {
+        return;
+    }
+
+    for (int g = 0; g < number_of_groups && g < MAX_PROFILED_GROUPS; g++)
+    {
+        char *name = profiling.group_names[g];
+        if (name[0] != '\0')
+        {
+            continue;
+        }
+
+        int length = 0;
+        for (int i = group_start[g]; i < group_start[g + 1]; i++)
+        {
+            length += snprintf(name + length, sizeof(profiling.group_names[g]) - length, "%s%s", 
+                               i > group_start[g] ? " " : "", specifications[i]);
+            if (length >= (int) sizeof(profiling.group_names[g]))
+            {
+                break;
+            }
+        }
+    }
+    profiling.number_of_groups = (int)fmax(profiling.number_of_groups, fmin(number_of_groups, MAX_PROFILED_GROUPS));
+}
+
+/****************************************************************************************************/
+
+#ifndef NO_MPI_PROFILE
+
+/**
+ *  @param: messages
+ *  @param: bytes
+ *  @param: count
+ *  @param: type
+ *  @param: number_of_messages
+ * 
+ *  Count number_of_messages messages of count elements of type.
+ **/
+void count_traffic(long long *messages, long long *bytes, int count, MPI_Datatype type, int number_of_messages)
+{
+    int type_size;
+    PMPI_Type_size(type, &type_size);
+    *messages += number_of_messages;
+    *bytes += (long long) count * type_size * number_of_messages;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The wrappers of the MPI calls of the program: each one calls the PMPI 
+ *  version and, only while the measures are taken, adds its time and traffic.
+ **/
+int MPI_Send(const void *buffer, int count, MPI_Datatype type, int destination, int tag, MPI_Comm communicator)
+{
+    double start = profile_clock();
+    int result = PMPI_Send(buffer, count, type, destination, tag, communicator);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+        if (destination != MPI_PROC_NULL)
+        {
+            count_traffic(&profiling.messages_sent, &profiling.bytes_sent, count, type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Recv(void *buffer, int count, MPI_Datatype type, int source, int tag, MPI_Comm communicator, MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_Recv(buffer, count, type, source, tag, communicator, status);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+        if (source != MPI_PROC_NULL)
+        {
+            count_traffic(&profiling.messages_received, &profiling.bytes_received, count, type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Isend(const void *buffer, int count, MPI_Datatype type, int destination, int tag, MPI_Comm communicator, 
+              MPI_Request *request)
+{
+    double start = profile_clock();
+    int result = PMPI_Isend(buffer, count, type, destination, tag, communicator, request);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+        if (destination != MPI_PROC_NULL)
+        {
+            count_traffic(&profiling.messages_sent, &profiling.bytes_sent, count, type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Irecv(void *buffer, int count, MPI_Datatype type, int source, int tag, MPI_Comm communicator, 
+              MPI_Request *request)
+{
+    double start = profile_clock();
+    int result = PMPI_Irecv(buffer, count, type, source, tag, communicator, request);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+        if (source != MPI_PROC_NULL)
+        {
+            count_traffic(&profiling.messages_received, &profiling.bytes_received, count, type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Probe(int source, int tag, MPI_Comm communicator, MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_Probe(source, tag, communicator, status);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_Wait(request, status);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    double start = profile_clock();
+    int result = PMPI_Waitall(count, requests, statuses);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_Barrier(MPI_Comm communicator)
+{
+    double start = profile_clock();
+    int result = PMPI_Barrier(communicator);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_Bcast(void *buffer, int count, MPI_Datatype type, int root, MPI_Comm communicator)
+{
+    double start = profile_clock();
+    int result = PMPI_Bcast(buffer, count, type, root, communicator);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+
+        int rank;
+        int number_of_processes;
+        PMPI_Comm_rank(communicator, &rank);
+        PMPI_Comm_size(communicator, &number_of_processes);
+        if (rank == root)
+        {
+            count_traffic(&profiling.messages_sent, &profiling.bytes_sent, count, type, number_of_processes - 1);
+        }
+        else
+        {
+            count_traffic(&profiling.messages_received, &profiling.bytes_received, count, type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Scatterv(const void *send_buffer, const int send_counts[], const int displacements[], MPI_Datatype send_type,
+                 void *receive_buffer, int receive_count, MPI_Datatype receive_type, int root, MPI_Comm communicator)
+{
+    double start = profile_clock();
+    int result = PMPI_Scatterv(send_buffer, send_counts, displacements, send_type, receive_buffer, receive_count, 
+                               receive_type, root, communicator);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+
+        int rank;
+        int number_of_processes;
+        PMPI_Comm_rank(communicator, &rank);
+        PMPI_Comm_size(communicator, &number_of_processes);
+        if (rank == root)
+        {
+            for (int i = 0; i < number_of_processes; i++)
+            {
+                if (i != root && send_counts[i] > 0)
+                {
+                    count_traffic(&profiling.messages_sent, &profiling.bytes_sent, send_counts[i], send_type, 1);
+                }
+            }
+        }
+        else if (receive_count > 0)
+        {
+            count_traffic(&profiling.messages_received, &profiling.bytes_received, receive_count, receive_type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_Gatherv(const void *send_buffer, int send_count, MPI_Datatype send_type, void *receive_buffer, 
+                const int receive_counts[], const int displacements[], MPI_Datatype receive_type, int root, 
+                MPI_Comm communicator)
+{
+    double start = profile_clock();
+    int result = PMPI_Gatherv(send_buffer, send_count, send_type, receive_buffer, receive_counts, displacements, 
+                              receive_type, root, communicator);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+
+        int rank;
+        int number_of_processes;
+        PMPI_Comm_rank(communicator, &rank);
+        PMPI_Comm_size(communicator, &number_of_processes);
+        if (rank == root)
+        {
+            for (int i = 0; i < number_of_processes; i++)
+            {
+                if (i != root && receive_counts[i] > 0)
+                {
+                    count_traffic(&profiling.messages_received, &profiling.bytes_received, receive_counts[i], receive_type, 1);
+                }
+            }
+        }
+        else if (send_count > 0)
+        {
+            count_traffic(&profiling.messages_sent, &profiling.bytes_sent, send_count, send_type, 1);
+        }
+    }
+    return result;
+}
+
+int MPI_File_open(MPI_Comm communicator, const char *name, int mode, MPI_Info info, MPI_File *file)
+{
+    double start = profile_clock();
+    int result = PMPI_File_open(communicator, name, mode, info, file);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_File_set_view(MPI_File file, MPI_Offset displacement, MPI_Datatype element_type, MPI_Datatype file_type, 
+                      const char *representation, MPI_Info info)
+{
+    double start = profile_clock();
+    int result = PMPI_File_set_view(file, displacement, element_type, file_type, representation, info);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_File_set_size(MPI_File file, MPI_Offset size)
+{
+    double start = profile_clock();
+    int result = PMPI_File_set_size(file, size);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_File_close(MPI_File *file)
+{
+    double start = profile_clock();
+    int result = PMPI_File_close(file);
+    if (profiling.enabled)
+    {
+        profiling.mpi_time += MPI_Wtime() - start;
+    }
+    return result;
+}
+
+int MPI_File_read_at(MPI_File file, MPI_Offset offset, void *buffer, int count, MPI_Datatype type, MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_File_read_at(file, offset, buffer, count, type, status);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_read, count, type, 1);
+    }
+    return result;
+}
+
+int MPI_File_read_at_all(MPI_File file, MPI_Offset offset, void *buffer, int count, MPI_Datatype type, 
+                         MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_File_read_at_all(file, offset, buffer, count, type, status);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_read, count, type, 1);
+    }
+    return result;
+}
+
+int MPI_File_iread_at(MPI_File file, MPI_Offset offset, void *buffer, int count, MPI_Datatype type, 
+                      MPI_Request *request)
+{
+    double start = profile_clock();
+    int result = PMPI_File_iread_at(file, offset, buffer, count, type, request);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_read, count, type, 1);
+    }
+    return result;
+}
+
+int MPI_File_write_at(MPI_File file, MPI_Offset offset, const void *buffer, int count, MPI_Datatype type, 
+                      MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_File_write_at(file, offset, buffer, count, type, status);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_written, count, type, 1);
+    }
+    return result;
+}
+
+int MPI_File_write_at_all(MPI_File file, MPI_Offset offset, const void *buffer, int count, MPI_Datatype type, 
+                          MPI_Status *status)
+{
+    double start = profile_clock();
+    int result = PMPI_File_write_at_all(file, offset, buffer, count, type, status);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_written, count, type, 1);
+    }
+    return result;
+}
+
+int MPI_File_iwrite_at(MPI_File file, MPI_Offset offset, const void *buffer, int count, MPI_Datatype type, 
+                       MPI_Request *request)
+{
+    double start = profile_clock();
+    int result = PMPI_File_iwrite_at(file, offset, buffer, count, type, request);
+    if (profiling.enabled)
+    {
+        long long messages = 0;
+        profiling.mpi_time += MPI_Wtime() - start;
+        count_traffic(&messages, &profiling.file_bytes_written, count, type, 1);
+    }
+    return result;
+}
+
+#endif
+
+/****************************************************************************************************/
+
+/**
+ *  The values of the measures of a process sent to the master: the phases, the
+ *  time in MPI, the six counters and the time of every group.
+ **/
+#define PROFILE_VALUES (NUMBER_OF_PHASES + 7 + MAX_PROFILED_GROUPS)
+
+/**
+ *  Stop the measures, gather them on the master and print them as CSV: one 
+ *  line for every process and the min, avg and max of every column, then the
+ *  time of every group of filters (min, avg and max over the processes).
+ **/
+void print_profile(void)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+    profiling.enabled = 0;
+
+    double values[PROFILE_VALUES];
+    memcpy(values, profiling.phase_time, NUMBER_OF_PHASES * sizeof(double));
+    values[NUMBER_OF_PHASES] = profiling.mpi_time;
+    values[NUMBER_OF_PHASES + 1] = profiling.messages_sent;
+    values[NUMBER_OF_PHASES + 2] = profiling.bytes_sent;
+    values[NUMBER_OF_PHASES + 3] = profiling.messages_received;
+    values[NUMBER_OF_PHASES + 4] = profiling.bytes_received;
+    values[NUMBER_OF_PHASES + 5] = profiling.file_bytes_read;
+    values[NUMBER_OF_PHASES + 6] = profiling.file_bytes_written;
+    memcpy(values + NUMBER_OF_PHASES + 7, profiling.group_time, MAX_PROFILED_GROUPS * sizeof(double));
+
+    double *all_values = NULL;
+    if (rank == MASTER)
+    {
+        all_values = (double *) malloc(number_of_processes * PROFILE_VALUES * sizeof(double));
+    }
+    MPI_Gather(values, PROFILE_VALUES, MPI_DOUBLE, all_values, PROFILE_VALUES, MPI_DOUBLE, MASTER, MPI_COMM_WORLD);
+    if (rank != MASTER)
+    {
+        return;
+    }
+
+    double summary[3][PROFILE_VALUES];
+    for (int v = 0; v < PROFILE_VALUES; v++)
+    {
+        summary[0][v] = summary[2][v] = all_values[v];
+        summary[1][v] = 0.0;
+        for (int p = 0; p < number_of_processes; p++)
+        {
+            double value = all_values[p * PROFILE_VALUES + v];
+            summary[0][v] = fmin(summary[0][v], value);
+            summary[1][v] += value / number_of_processes;
+            summary[2][v] = fmax(summary[2][v], value);
+        }
+    }
+
+    const char *summary_names[3] = {"min", "avg", "max"};
+    printf("rank,read,distribute,halo_wait,filter,collect,write,mpi,messages_sent,bytes_sent,"
+           "messages_received,bytes_received,file_bytes_read,file_bytes_written\n");
+    for (int row = 0; row < number_of_processes + 3; row++)
+    {
+        double *line = row < number_of_processes ? &all_values[row * PROFILE_VALUES] : summary[row - number_of_processes];
+        if (row < number_of_processes)
+        {
+            printf("%d", row);
+        }
+        else
+        {
+            printf("%s", summary_names[row - number_of_processes]);
+        }
+
+        for (int v = 0; v <= NUMBER_OF_PHASES; v++)
+        {
+            printf(",%.6f", line[v]);
+        }
+        for (int v = NUMBER_OF_PHASES + 1; v < NUMBER_OF_PHASES + 7; v++)
+        {
+            printf(",%.0f", line[v]);
+        }
+        printf("\n");
+    }
+
+    printf("group,filters,min,avg,max\n");
+    for (int g = 0; g < profiling.number_of_groups; g++)
+    {
+        int v = NUMBER_OF_PHASES + 7 + g;
+        printf("%d,\"%s\",%.6f,%.6f,%.6f\n", g, profiling.group_names[g], summary[0][v], summary[1][v], summary[2][v]);
+    }
+
+    free(all_values);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The following functions repesent the API that handles the processes reposnse
+ *  and action to specific images, so basically the image processing parallel API.
+ * 
+ **/ 
+
+/**
+ * @param: type
+ * @param: width
+ * 
+ * Create the MPI datatype of one line of the image: width unsigned chars for a
+ * PGM image and width pixels (a derived type of 3 unsigned chars) for a PNM one.
+ * All the transfers of the image are done in lines, so the counts used by the 
+ * collectives are lines and not bytes.
+ **/
+MPI_Datatype create_line_type(int type, int width)
+{
+    MPI_Datatype line_type;
+
+    if (type == PGM)
+    {
+        MPI_Type_contiguous(width, MPI_UNSIGNED_CHAR, &line_type);
+    }
+    else
+    {
+        MPI_Datatype pixel_type;
+        MPI_Type_contiguous(3, MPI_UNSIGNED_CHAR, &pixel_type);
+        MPI_Type_contiguous(width, pixel_type, &line_type);
+        MPI_Type_free(&pixel_type);
+    }
+
+    MPI_Type_commit(&line_type);
+    return line_type;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: input_file_name
+ * @param: output_file_name
+ * @param: header -> filled on all the processes
+ * @param: files
+ * 
+ * Open the images for the MPI-IO path. Only the master parses the header of
+ * the input image; the header and the offset of the first pixel are broadcasted.
+ * The header of the output is written by the master and the output file gets
+ * its final size, so that every process can write its lines at their offset.
+ **/
+void open_parallel_files(char *input_file_name, char *output_file_name, int header[4], parallel_files *files)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    long long input_offset;
+    if (rank == MASTER)
+    {
+        input_offset = read_header(input_file_name, header);
+    }
+    MPI_Bcast(header, 4, MPI_INT, MASTER, MPI_COMM_WORLD);
+    MPI_Bcast(&input_offset, 1, MPI_LONG_LONG, MASTER, MPI_COMM_WORLD);
+
+    char text[64];
+    int length = format_header(header, text);
+
+    files -> input_offset = input_offset;
+    files -> output_offset = length;
+    files -> line_bytes = (MPI_Offset) (header[0] == PGM ? 1 : 3) * header[1];
+
+    if (MPI_File_open(MPI_COMM_WORLD, input_file_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &files -> input) != MPI_SUCCESS ||
+        MPI_File_open(MPI_COMM_WORLD, output_file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &files -> output) != MPI_SUCCESS)
+    {
+        if (rank == MASTER)
+        {
+            printf("The file can't be opened!\n");
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    MPI_File_set_size(files -> output, files -> output_offset + header[2] * files -> line_bytes);
+    if (rank == MASTER)
+    {
+        MPI_File_write_at(files -> output, 0, text, length, MPI_CHAR, MPI_STATUS_IGNORE);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: files
+ **/
+void close_parallel_files(parallel_files *files)
+{
+    MPI_File_close(&files -> input);
+    MPI_File_close(&files -> output);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: type
+ * @param: width
+ * @param: height
+ * @param: max_val
+ * @param: node -> the processes of a node
+ * @param: window -> the window of the lines, released by free_shared_image
+ * 
+ * Allocate an image in the memory shared by the processes of a node: the first
+ * process of the node allocates all the lines (MPI_Win_allocate_shared) and the
+ * others only map them, so all of them see the same pixels. The lines are zero.
+ * The window is kept open (MPI_Win_lock_all) until the image is released.
+ **/
+Image *allocate_shared_image(int type, int width, int height, int max_val, MPI_Comm node, MPI_Win *window)
+{
+    int node_rank;
+    MPI_Comm_rank(node, &node_rank);
+
+    Image *image = (Image *) malloc(sizeof(Image));
+    image -> type = type;
+    image -> width = width;
+    image -> height = height;
+    image -> max_val = max_val;
+    image -> image = NULL;
+    image -> color_image = NULL;
+    image -> mapping = NULL;
+    image -> mapping_size = 0;
+
+    int lines = height > 0 ? height : 1;
+    size_t line_bytes = (type == PGM ? sizeof(unsigned char) : sizeof(pixel)) * (size_t) width;
+
+    unsigned char *content;
+    MPI_Win_allocate_shared(node_rank == 0 ? lines * line_bytes : 0, 1, MPI_INFO_NULL, node, &content, window);
+
+    MPI_Aint size;
+    int unit;
+    MPI_Win_shared_query(*window, 0, &size, &unit, &content);
+    if (node_rank == 0)
+    {
+        memset(content, 0, lines * line_bytes);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, *window);
+
+    if (type == PGM)
+    {
+        image -> image = (unsigned char **) malloc(lines * sizeof(unsigned char *));
+        for (int line = 0; line < lines; ++line)
+        {
+            image -> image[line] = content + (size_t) line * line_bytes;
+        }
+    }
+    else
+    {
+        image -> color_image = (pixel **) malloc(lines * sizeof(pixel *));
+        for (int line = 0; line < lines; ++line)
+        {
+            image -> color_image[line] = (pixel *) (content + (size_t) line * line_bytes);
+        }
+    }
+
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image -> an image of allocate_shared_image
+ * @param: window
+ **/
+void free_shared_image(Image *image, MPI_Win *window)
+{
+    MPI_Win_unlock_all(*window);
+    MPI_Win_free(window);
+
+    free(image -> image);
+    free(image -> color_image);
+    free(image);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: windows -> the two windows of the shared images
+ * @param: node
+ * 
+ * Wait for all the processes of the node; the lines written by any of them
+ * before are then visible to all the others.
+ **/
+void synchronize_node(MPI_Win windows[2], MPI_Comm node)
+{
+    MPI_Win_sync(windows[0]);
+    MPI_Win_sync(windows[1]);
+    MPI_Barrier(node);
+    MPI_Win_sync(windows[0]);
+    MPI_Win_sync(windows[1]);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: height
+ * @param: number_of_processes
+ * @param: rank
+ * @param: low_bound
+ * @param: high_bound
+ * 
+ * Compute the lines [low_bound, high_bound) of the image that belong to a process.
+ * The ceil division leaves the last processes with an empty strip when there are
+ * more processes than lines, so the bounds are clamped to the image height.
+ **/ 
+void get_strip_bounds(int height, int number_of_processes, int rank, int *low_bound, int *high_bound)
+{
+    int division_ratio = (int)ceil((1.0 * height) / number_of_processes);
+    *low_bound = (int)fmin(division_ratio * rank, height);
+    *high_bound = (int)fmin(division_ratio * (rank + 1), height);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: height
+ * @param: number_of_strips
+ * @param: number_of_processes
+ * @param: counts
+ * @param: displacements
+ * 
+ * Fill the number of lines and the first line of every strip, as they are
+ * needed by MPI_Scatterv and MPI_Gatherv.
+ **/ 
+void get_strips_layout(int height, int number_of_strips, int number_of_processes, int *counts, int *displacements)
+{
+    for (int i = 0; i < number_of_processes; i++)
+    {
+        int low_bound;
+        int high_bound;
+        get_strip_bounds(height, number_of_strips, i, &low_bound, &high_bound);
+        counts[i] = high_bound - low_bound;
+        displacements[i] = low_bound;
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Compressed transport (--compress). The blocks of lines sent by the scatter,
+ *  the gather and the dynamic scheduling are compressed before they are sent
+ *  and decompressed when they arrive. The lines are cut in blocks of 
+ *  COMPRESSION_BLOCK_BYTES; every block is replaced by the differences between
+ *  every byte and the same channel of the previous pixel (so the smooth areas
+ *  and the flat areas of the filtered images become runs of small or zero 
+ *  values) encoded with a run length code, or sent raw if that is not smaller.
+ *  A block is 1 byte of method, 4 bytes of size and its payload.
+ * 
+ *  Run length code: a byte c < 128 is followed by c + 1 literal bytes, a byte
+ *  c >= 128 by one byte repeated c - 125 times (3 to 130).
+ **/ 
+
+/**
+ *  @param: source
+ *  @param: length
+ *  @param: destination -> at least length + length / 128 + 1 bytes
+ * 
+ *  Returns the size of the run length code of the source.
+ **/
+size_t encode_runs(const unsigned char *source, size_t length, unsigned char *destination)
+{
+    size_t size = 0;
+    size_t position = 0;
+
+    while (position < length)
+    {
+        size_t run = 1;
+        while (position + run < length && run < 130 && source[position + run] == source[position])
+        {
+            run++;
+        }
+
+        if (run >= 3)
+        {
+            destination[size++] = (unsigned char) (run + 125);
+            destination[size++] = source[position];
+            position += run;
+            continue;
+        }
+
+        size_t start = position;
+        while (position < length && position - start < 128 &&
+               !(position + 2 < length && source[position] == source[position + 1] && source[position] == source[position + 2]))
+        {
+            position++;
+        }
+        destination[size++] = (unsigned char) (position - start - 1);
+        memcpy(destination + size, source + start, position - start);
+        size += position - start;
+    }
+
+    return size;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source
+ *  @param: destination
+ *  @param: length -> the bytes of the decoded block
+ * 
+ *  Decode the run length code of a block.
+ **/
+void decode_runs(const unsigned char *source, unsigned char *destination, size_t length)
+{
+    size_t position = 0;
+    while (position < length)
+    {
+        unsigned char control = *source++;
+        if (control >= 128)
+        {
+            memset(destination + position, *source++, control - 125);
+            position += control - 125;
+        }
+        else
+        {
+            memcpy(destination + position, source, control + 1);
+            source += control + 1;
+            position += control + 1;
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: length
+ * 
+ *  The largest size of the compressed form of length bytes.
+ **/
+size_t get_compressed_capacity(size_t length)
+{
+    size_t blocks = (length + COMPRESSION_BLOCK_BYTES - 1) / COMPRESSION_BLOCK_BYTES;
+    return length + blocks * 5 + 1;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source
+ *  @param: length
+ *  @param: step -> the bytes of a pixel
+ *  @param: destination -> get_compressed_capacity(length) bytes
+ * 
+ *  Compress the lines of a block; returns the size of the compressed form.
+ **/
+size_t compress_lines(const unsigned char *source, size_t length, int step, unsigned char *destination)
+{
+    double start = MPI_Wtime();
+    unsigned char *differences = (unsigned char *) malloc(COMPRESSION_BLOCK_BYTES);
+    unsigned char *code = (unsigned char *) malloc(COMPRESSION_BLOCK_BYTES + COMPRESSION_BLOCK_BYTES / 128 + 1);
+    size_t size = 0;
+
+    for (size_t offset = 0; offset < length; offset += COMPRESSION_BLOCK_BYTES)
+    {
+        size_t block = (size_t)fmin(COMPRESSION_BLOCK_BYTES, length - offset);
+        const unsigned char *bytes = source + offset;
+
+        for (size_t i = 0; i < block; i++)
+        {
+            differences[i] = (unsigned char) (bytes[i] - (i >= (size_t) step ? bytes[i - step] : 0));
+        }
+        size_t code_size = encode_runs(differences, block, code);
+
+        unsigned int payload;
+        if (code_size < block)
+        {
+            destination[size] = BLOCK_DELTA_RLE;
+            memcpy(destination + size + 5, code, code_size);
+            payload = code_size;
+            transport.compressed_blocks++;
+        }
+        else
+        {
+            destination[size] = BLOCK_RAW;
+            memcpy(destination + size + 5, bytes, block);
+            payload = block;
+            transport.raw_blocks++;
+        }
+        memcpy(destination + size + 1, &payload, 4);
+        size += 5 + payload;
+    }
+
+    free(differences);
+    free(code);
+    transport.raw_bytes += length;
+    transport.sent_bytes += size;
+    transport.time += MPI_Wtime() - start;
+
+    return size;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source -> the compressed form of the lines
+ *  @param: destination
+ *  @param: length -> the bytes of the lines
+ *  @param: step
+ **/
+void decompress_lines(const unsigned char *source, unsigned char *destination, size_t length, int step)
+{
+    double start = MPI_Wtime();
+
+    for (size_t offset = 0; offset < length; offset += COMPRESSION_BLOCK_BYTES)
+    {
+        size_t block = (size_t)fmin(COMPRESSION_BLOCK_BYTES, length - offset);
+        unsigned char *bytes = destination + offset;
+        unsigned int payload;
+        memcpy(&payload, source + 1, 4);
+
+        if (source[0] == BLOCK_RAW)
+        {
+            memcpy(bytes, source + 5, block);
+        }
+        else
+        {
+            decode_runs(source + 5, bytes, block);
+            for (size_t i = step; i < block; i++)
+            {
+                bytes[i] = (unsigned char) (bytes[i] + bytes[i - step]);
+            }
+        }
+        source += 5 + payload;
+    }
+
+    transport.time += MPI_Wtime() - start;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image
+ *  @param: first
+ *  @param: count
+ *  @param: destination
+ *  @param: tag
+ *  @param: communicator
+ *  @param: request -> the send is only started; the buffer returned is released
+ *                     by the caller after the request is completed
+ * 
+ *  Start the send of count lines of the image, compressed.
+ **/
+unsigned char *start_send_lines(Image *image, int first, int count, int destination, int tag, 
+                                MPI_Comm communicator, MPI_Request *request)
+{
+    int step = image -> type == PGM ? 1 : 3;
+    size_t length = (size_t) count * step * image -> width;
+    unsigned char *buffer = (unsigned char *) malloc(get_compressed_capacity(length));
+    size_t size = compress_lines((unsigned char *) get_line(image, first), length, step, buffer);
+
+    MPI_Isend(buffer, (int) size, MPI_BYTE, destination, tag, communicator, request);
+    return buffer;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image
+ *  @param: first
+ *  @param: count
+ *  @param: destination
+ *  @param: tag
+ *  @param: communicator
+ * 
+ *  Send count lines of the image, compressed.
+ **/
+void send_lines(Image *image, int first, int count, int destination, int tag, MPI_Comm communicator)
+{
+    MPI_Request request;
+    unsigned char *buffer = start_send_lines(image, first, count, destination, tag, communicator, &request);
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+    free(buffer);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image
+ *  @param: first
+ *  @param: count
+ *  @param: source -> a rank or MPI_ANY_SOURCE
+ *  @param: tag
+ *  @param: communicator
+ * 
+ *  Receive count lines of the image sent by send_lines; returns the rank of the sender.
+ **/
+int receive_lines(Image *image, int first, int count, int source, int tag, MPI_Comm communicator)
+{
+    MPI_Status status;
+    int size;
+    MPI_Probe(source, tag, communicator, &status);
+    MPI_Get_count(&status, MPI_BYTE, &size);
+
+    unsigned char *buffer = (unsigned char *) malloc(size > 0 ? size : 1);
+    MPI_Recv(buffer, size, MPI_BYTE, status.MPI_SOURCE, tag, communicator, MPI_STATUS_IGNORE);
+
+    int step = image -> type == PGM ? 1 : 3;
+    decompress_lines(buffer, (unsigned char *) get_line(image, first), (size_t) count * step * image -> width, step);
+    free(buffer);
+
+    return status.MPI_SOURCE;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Print on the master the measures of the compressed transport of all the processes.
+ **/
+void print_compression(void)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    double values[5] = {transport.raw_bytes, transport.sent_bytes, transport.compressed_blocks, 
+                        transport.raw_blocks, transport.time};
+    double totals[5];
+    MPI_Reduce(values, totals, 5, MPI_DOUBLE, MPI_SUM, MASTER, MPI_COMM_WORLD);
+
+    if (rank == MASTER)
+    {
+        printf("compression: %.0f bytes of lines sent as %.0f bytes (ratio %.2f), %.0f blocks compressed, "
+               "%.0f raw, %.6f s to compress and decompress\n", totals[0], totals[1], 
+               totals[1] > 0 ? totals[0] / totals[1] : 1.0, totals[2], totals[3], totals[4]);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image -> only significant on master
+ * @param: strip
+ * @param: height -> height of the whole image
+ * @param: number_of_strips
+ * @param: halo
+ * @param: line_type
+ * @param: communicator -> the processes of the strips, master being the first one
+ * 
+ * Scatter the lines of the image from master to all the processes, every strip
+ * being received after its halo lines.
+ **/
+void scatter_image(Image *image, Image *strip, int height, int number_of_strips, int halo, MPI_Datatype line_type,
+                   MPI_Comm communicator)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(communicator, &rank);
+    MPI_Comm_size(communicator, &number_of_processes);
+
+    int *counts = (int *) malloc(number_of_processes * sizeof(int));
+    int *displacements = (int *) malloc(number_of_processes * sizeof(int));
+    get_strips_layout(height, number_of_strips, number_of_processes, counts, displacements);
+
+    /**
+     *  With the compressed transport the master compresses the strip of every
+     *  process and starts its send, so the next strip is compressed while the
+     *  previous one is on its way.
+     **/ 
+    if (transport.enabled)
+    {
+        if (rank == MASTER)
+        {
+            MPI_Request *requests = (MPI_Request *) malloc(number_of_processes * sizeof(MPI_Request));
+            unsigned char **buffers = (unsigned char **) calloc(number_of_processes, sizeof(unsigned char *));
+            requests[MASTER] = MPI_REQUEST_NULL;
+            for (int p = 1; p < number_of_processes; p++)
+            {
+                requests[p] = MPI_REQUEST_NULL;
+                if (counts[p] > 0)
+                {
+                    buffers[p] = start_send_lines(image, displacements[p], counts[p], p, DEFAULT_TAG, communicator, &requests[p]);
+                }
+            }
+            memcpy(get_line(strip, halo), get_line(image, displacements[MASTER]), 
+                   (size_t) counts[MASTER] * (image -> type == PGM ? 1 : 3) * image -> width);
+            MPI_Waitall(number_of_processes, requests, MPI_STATUSES_IGNORE);
+            for (int p = 0; p < number_of_processes; p++)
+            {
+                free(buffers[p]);
+            }
+            free(buffers);
+            free(requests);
+        }
+        else if (counts[rank] > 0)
+        {
+            receive_lines(strip, halo, counts[rank], MASTER, DEFAULT_TAG, communicator);
+        }
+
+        free(counts);
+        free(displacements);
+        return;
+    }
+
+    MPI_Scatterv(rank == MASTER ? get_line(image, 0) : NULL, counts, displacements, line_type,
+                 get_line(strip, halo), counts[rank], line_type, MASTER, communicator);
+
+    free(counts);
+    free(displacements);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image -> only significant on master
+ * @param: strip
+ * @param: height -> height of the whole image
+ * @param: number_of_strips
+ * @param: halo
+ * @param: line_type
+ * @param: communicator
+ * 
+ * The reverse of scatter_image: master gathers the strips of all processes
+ * (without their halo lines) directly in the lines of the result image.
+ **/
+void gather_image(Image *image, Image *strip, int height, int number_of_strips, int halo, MPI_Datatype line_type,
+                  MPI_Comm communicator)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(communicator, &rank);
+    MPI_Comm_size(communicator, &number_of_processes);
+
+    int *counts = (int *) malloc(number_of_processes * sizeof(int));
+    int *displacements = (int *) malloc(number_of_processes * sizeof(int));
+    get_strips_layout(height, number_of_strips, number_of_processes, counts, displacements);
+
+    /**
+     *  With the compressed transport the master takes the strips in the order
+     *  they arrive.
+     **/ 
+    if (transport.enabled)
+    {
+        if (rank == MASTER)
+        {
+            memcpy(get_line(image, displacements[MASTER]), get_line(strip, halo), 
+                   (size_t) counts[MASTER] * (image -> type == PGM ? 1 : 3) * image -> width);
+
+            for (int p = 1; p < number_of_processes; p++)
+            {
+                if (counts[p] == 0)
+                {
+                    continue;
+                }
+
+                MPI_Status status;
+                MPI_Probe(MPI_ANY_SOURCE, DEFAULT_TAG, communicator, &status);
+                int source = status.MPI_SOURCE;
+                receive_lines(image, displacements[source], counts[source], source, DEFAULT_TAG, communicator);
+            }
+        }
+        else if (counts[rank] > 0)
+        {
+            send_lines(strip, halo, counts[rank], MASTER, DEFAULT_TAG, communicator);
+        }
+
+        free(counts);
+        free(displacements);
+        return;
+    }
+
+    MPI_Gatherv(get_line(strip, halo), counts[rank], line_type,
+                rank == MASTER ? get_line(image, 0) : NULL, counts, displacements, line_type,
+                MASTER, communicator);
+
+    free(counts);
+    free(displacements);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: strip
+ * @param: halo -> number of halo lines above and under the strip
+ * @param: radius -> number of lines needed by the current filter
+ * @param: down_lines -> number of lines in the strip of the process under
+ * @param: up
+ * @param: down
+ * @param: line_type
+ * @param: requests -> 4 requests, completed by the caller with MPI_Waitall
+ * @param: communicator -> up and down are ranks of it
+ * 
+ * The strip of a process is kept between filters as lines [halo, height - halo) with 
+ * halo lines above and under it. Before every filter the process sends its first
+ * radius lines to the process above and its last radius lines to the process under
+ * it, receiving their boundary lines in its halo lines. At the top and the bottom 
+ * of the image the neighbour is MPI_PROC_NULL, so the halo stays zero as the 
+ * original padding. Only the last strip can have less than radius lines, then it
+ * sends all of them and the rest of the halo of its neighbour stays zero.
+ * 
+ * The transfers are only started here, so that the process can filter the
+ * interior lines of its strip (which do not need the halo) while they are in flight.
+ **/ 
+void start_halo_exchange(Image *strip, int halo, int radius, int down_lines, int up, int down, 
+                         MPI_Datatype line_type, MPI_Request *requests, MPI_Comm communicator)
+{
+    int rows = strip -> height - 2 * halo;
+    int up_lines = rows < radius ? rows : radius;
+    int down_count = down_lines < radius ? down_lines : radius;
+
+    MPI_Irecv(get_line(strip, halo - radius), radius, line_type, up, DEFAULT_TAG, communicator, &requests[0]);
+    MPI_Irecv(get_line(strip, halo + rows), down_count, line_type, down, DEFAULT_TAG, communicator, &requests[1]);
+    MPI_Isend(get_line(strip, halo), up_lines, line_type, up, DEFAULT_TAG, communicator, &requests[2]);
+    MPI_Isend(get_line(strip, halo + rows - radius), radius, line_type, down, DEFAULT_TAG, communicator, &requests[3]);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The following functions are the fixed point kernels of the filters that have
+ *  an integer form (all the built-in ones). A line is seen as a vector of bytes,
+ *  so the same kernels work for PGM lines (step 1) and PNM lines (step 3, as the
+ *  neighbour of a channel is 3 bytes away and the channels do not mix).
+ * 
+ *  The result is floor(sum / divisor), with sum the exact integer sum of the
+ *  weights multiplied by the pixels, clamped to [0, 255]. The float path makes
+ *  an error far smaller than 1 / divisor, so it truncates to the same value,
+ *  except when sum / divisor is an integer: the float value can then be just
+ *  under it. Only for those bytes (and only when the divisor is not a power
+ *  of 2, as then the float path is exact) the value is computed again with the
+ *  float path, so the results are bit-exact with it.
+ * 
+ **/ 
+
+/**
+ *  @param: lines -> the line above, the current line and the line under it
+ *  @param: position
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ * 
+ *  One byte of the result computed with the float path. It also ensure that 
+ *  there is no overflow or underflow by clamping values to 0 for negative ones
+ *  and to 255 for unsigned char values that goes above the max value.
+ * 
+ *  This is the reference for all the other kernels of the built-in filters: 
+ *  the order of the operations must not be changed, as the results depend on it.
+ *  The lines outside the image are zero lines, which add nothing to the sum.
+ **/
+unsigned char filter_byte_float(unsigned char **lines, int position, int step, int length, const filter *current_filter)
+{
+    float result_value = 0.0;
+
+    for (int offset_i = -1; offset_i <= 1; offset_i++)
+    {
+        for (int offset_j = -1; offset_j <= 1; offset_j++)
+        {
+            int neighbour = position + offset_j * step;
+            if (neighbour < 0 || neighbour >= length)
+            {
+                result_value += 0.0;
+            }
+            else
+            {
+                float image_value = (float) lines[offset_i + 1][neighbour];
+                float filter_associated_value = current_filter -> values[1 - offset_i][1 - offset_j];
+                result_value += (filter_associated_value * image_value);
+            }
+        }
+    }
+
+    if (result_value > 255) result_value = 255;
+    if (result_value < 0) result_value = 0;
+
+    return (unsigned char) result_value;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: sum
+ *  @param: divisor
+ * 
+ *  Check if the float path could give a different result than the exact one.
+ **/
+int needs_float_check(int sum, int divisor)
+{
+    return (divisor & (divisor - 1)) != 0 && sum > 0 && sum < 256 * divisor && sum % divisor == 0;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: lines -> the line above, the current line and the line under it
+ *  @param: position
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ * 
+ *  One byte of the result computed in integers, used for the bytes at the
+ *  ends of the lines that the vector kernels do not handle.
+ **/
+unsigned char filter_byte_fixed_point(unsigned char **lines, int position, int step, int length, const filter *current_filter)
+{
+    int sum = 0;
+
+    for (int offset_i = -1; offset_i <= 1; offset_i++)
+    {
+        for (int offset_j = -1; offset_j <= 1; offset_j++)
+        {
+            int neighbour = position + offset_j * step;
+            if (neighbour >= 0 && neighbour < length)
+            {
+                sum += current_filter -> weights[1 - offset_i][1 - offset_j] * lines[offset_i + 1][neighbour];
+            }
+        }
+    }
+
+    if (needs_float_check(sum, current_filter -> divisor))
+    {
+        return filter_byte_float(lines, position, step, length, current_filter);
+    }
+
+    int result_value = sum < 0 ? 0 : sum / current_filter -> divisor;
+
+    return result_value > 255 ? 255 : result_value;
+}
+
+/****************************************************************************************************/
+
+#if defined(__SSE2__)
+
+/**
+ *  The vector kernels keep the sums in 16 bit lanes, which is enough for the
+ *  built-in filters (|sum| <= 16 * 255). The division is a multiplication with
+ *  ceil(2^16 / divisor) keeping the high half, exact for sum < 256 * divisor;
+ *  over that the result is saturated to 255 anyway.
+ * 
+ *  The bodies of the kernels take the weights and the divisor as parameters 
+ *  and are always inlined: DEFINE_FIXED_POINT_KERNELS instantiates them with 
+ *  the constant weights of every built-in filter, so the compiler folds the 
+ *  constants, drops the zero taps, turns the weights 1, -1 and powers of 2 in
+ *  additions, subtractions and shifts and, for the filters with equal corners
+ *  and equal edges, multiplies the sum of the corners and the sum of the edges
+ *  once. The generic kernels (weights read from the filter) are kept for any
+ *  other integer filter.
+ **/ 
+
+/**
+ *  @param: sum
+ *  @param: value
+ *  @param: weight
+ * 
+ *  sum + weight * value in 16 bit lanes.
+ **/
+static inline __attribute__((always_inline))
+__m128i add_weighted_sse2(__m128i sum, __m128i value, int weight)
+{
+    int magnitude = weight < 0 ? -weight : weight;
+    __m128i scaled;
+
+    if (weight == 0)
+    {
+        return sum;
+    }
+    if (magnitude == 1)
+    {
+        scaled = value;
+    }
+    else if ((magnitude & (magnitude - 1)) == 0)
+    {
+        scaled = _mm_sll_epi16(value, _mm_cvtsi32_si128(__builtin_ctz(magnitude)));
+    }
+    else
+    {
+        scaled = _mm_mullo_epi16(value, _mm_set1_epi16((short) magnitude));
+    }
+
+    return weight < 0 ? _mm_sub_epi16(sum, scaled) : _mm_add_epi16(sum, scaled);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: lines -> the line above, the current line and the line under it
+ *  @param: result_line
+ *  @param: position -> first byte, at least step
+ *  @param: end -> the bytes [position, end) are computed, end <= length - step
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter -> for the bytes computed again with the float path
+ *  @param: weights -> the 9 weights of the filter, line by line
+ *  @param: divisor
+ * 
+ *  SSE2 kernel: 16 bytes of the result for every iteration. Returns the first
+ *  byte that was not computed. The tap of the line i and the column j (both 
+ *  in 0..2) has the weight weights[8 - 3 * i - j], as the filter is flipped.
+ **/
+static inline __attribute__((always_inline))
+int filter_bytes_sse2_body(unsigned char **lines, unsigned char *result_line, int position, int end, int step, 
+                           int length, const filter *current_filter, const short *weights, int divisor)
+{
+    int check = (divisor & (divisor - 1)) != 0;
+    int symmetric = weights[0] == weights[2] && weights[0] == weights[6] && weights[0] == weights[8] &&
+                    weights[1] == weights[3] && weights[1] == weights[5] && weights[1] == weights[7];
+    __m128i zero = _mm_setzero_si128();
+    __m128i magic = _mm_set1_epi16((short) ((65536 + divisor - 1) / divisor));
+    __m128i divisor_vector = _mm_set1_epi16((short) divisor);
+    __m128i limit = _mm_set1_epi16((short) (256 * divisor));
+
+    for (; position + 16 <= end; position += 16)
+    {
+        __m128i low[9];
+        __m128i high[9];
+#pragma GCC unroll 9
+        for (int tap = 0; tap < 9; tap++)
+        {
+            __m128i bytes = _mm_loadu_si128((__m128i *) (lines[tap / 3] + position + (tap % 3 - 1) * step));
+            low[tap] = _mm_unpacklo_epi8(bytes, zero);
+            high[tap] = _mm_unpackhi_epi8(bytes, zero);
+        }
+
+        __m128i sum_low = zero;
+        __m128i sum_high = zero;
+        if (symmetric)
+        {
+            __m128i corners_low = _mm_add_epi16(_mm_add_epi16(low[0], low[2]), _mm_add_epi16(low[6], low[8]));
+            __m128i corners_high = _mm_add_epi16(_mm_add_epi16(high[0], high[2]), _mm_add_epi16(high[6], high[8]));
+            __m128i edges_low = _mm_add_epi16(_mm_add_epi16(low[1], low[3]), _mm_add_epi16(low[5], low[7]));
+            __m128i edges_high = _mm_add_epi16(_mm_add_epi16(high[1], high[3]), _mm_add_epi16(high[5], high[7]));
+            sum_low = add_weighted_sse2(add_weighted_sse2(add_weighted_sse2(sum_low, corners_low, weights[0]), 
+                                                          edges_low, weights[1]), low[4], weights[4]);
+            sum_high = add_weighted_sse2(add_weighted_sse2(add_weighted_sse2(sum_high, corners_high, weights[0]), 
+                                                           edges_high, weights[1]), high[4], weights[4]);
+        }
+        else
+        {
+#pragma GCC unroll 9
+            for (int tap = 0; tap < 9; tap++)
+            {
+                sum_low = add_weighted_sse2(sum_low, low[tap], weights[8 - tap]);
+                sum_high = add_weighted_sse2(sum_high, high[tap], weights[8 - tap]);
+            }
+        }
+
+        __m128i quotient_low = sum_low;
+        __m128i quotient_high = sum_high;
+        int float_checks = 0;
+
+        if (divisor != 1)
+        {
+            sum_low = _mm_max_epi16(sum_low, zero);
+            sum_high = _mm_max_epi16(sum_high, zero);
+            quotient_low = _mm_mulhi_epu16(sum_low, magic);
+            quotient_high = _mm_mulhi_epu16(sum_high, magic);
+        }
+
+        if (check)
+        {
+            __m128i exact_low = _mm_cmpeq_epi16(_mm_mullo_epi16(quotient_low, divisor_vector), sum_low);
+            __m128i exact_high = _mm_cmpeq_epi16(_mm_mullo_epi16(quotient_high, divisor_vector), sum_high);
+            exact_low = _mm_and_si128(exact_low, _mm_and_si128(_mm_cmpgt_epi16(sum_low, zero), _mm_cmplt_epi16(sum_low, limit)));
+            exact_high = _mm_and_si128(exact_high, _mm_and_si128(_mm_cmpgt_epi16(sum_high, zero), _mm_cmplt_epi16(sum_high, limit)));
+            float_checks = _mm_movemask_epi8(_mm_packs_epi16(exact_low, exact_high));
+        }
+
+        _mm_storeu_si128((__m128i *) (result_line + position), _mm_packus_epi16(quotient_low, quotient_high));
+
+        while (float_checks)
+        {
+            int lane = __builtin_ctz(float_checks);
+            result_line[position + lane] = filter_byte_float(lines, position + lane, step, length, current_filter);
+            float_checks &= float_checks - 1;
+        }
+    }
+
+    return position;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: sum
+ *  @param: value
+ *  @param: weight
+ * 
+ *  The AVX2 form of add_weighted_sse2.
+ **/
+static inline __attribute__((always_inline, target("avx2")))
+__m256i add_weighted_avx2(__m256i sum, __m256i value, int weight)
+{
+    int magnitude = weight < 0 ? -weight : weight;
+    __m256i scaled;
+
+    if (weight == 0)
+    {
+        return sum;
+    }
+    if (magnitude == 1)
+    {
+        scaled = value;
+    }
+    else if ((magnitude & (magnitude - 1)) == 0)
+    {
+        scaled = _mm256_sll_epi16(value, _mm_cvtsi32_si128(__builtin_ctz(magnitude)));
+    }
+    else
+    {
+        scaled = _mm256_mullo_epi16(value, _mm256_set1_epi16((short) magnitude));
+    }
+
+    return weight < 0 ? _mm256_sub_epi16(sum, scaled) : _mm256_add_epi16(sum, scaled);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: lines -> the line above, the current line and the line under it
+ *  @param: result_line
+ *  @param: position -> first byte, at least step
+ *  @param: end -> the bytes [position, end) are computed, end <= length - step
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ *  @param: weights
+ *  @param: divisor
+ * 
+ *  AVX2 kernel, the same as the SSE2 one but with 32 bytes of the result for
+ *  every iteration. It is compiled for AVX2 only here and it is used only if
+ *  the processor supports it.
+ **/
+static inline __attribute__((always_inline, target("avx2")))
+int filter_bytes_avx2_body(unsigned char **lines, unsigned char *result_line, int position, int end, int step, 
+                           int length, const filter *current_filter, const short *weights, int divisor)
+{
+    int check = (divisor & (divisor - 1)) != 0;
+    int symmetric = weights[0] == weights[2] && weights[0] == weights[6] && weights[0] == weights[8] &&
+                    weights[1] == weights[3] && weights[1] == weights[5] && weights[1] == weights[7];
+    __m256i zero = _mm256_setzero_si256();
+    __m256i magic = _mm256_set1_epi16((short) ((65536 + divisor - 1) / divisor));
+    __m256i divisor_vector = _mm256_set1_epi16((short) divisor);
+    __m256i limit = _mm256_set1_epi16((short) (256 * divisor));
+
+    for (; position + 32 <= end; position += 32)
+    {
+        __m256i low[9];
+        __m256i high[9];
+#pragma GCC unroll 9
+        for (int tap = 0; tap < 9; tap++)
+        {
+            unsigned char *bytes = lines[tap / 3] + position + (tap % 3 - 1) * step;
+            low[tap] = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) bytes));
+            high[tap] = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (bytes + 16)));
+        }
+
+        __m256i sum_low = zero;
+        __m256i sum_high = zero;
+        if (symmetric)
+        {
+            __m256i corners_low = _mm256_add_epi16(_mm256_add_epi16(low[0], low[2]), _mm256_add_epi16(low[6], low[8]));
+            __m256i corners_high = _mm256_add_epi16(_mm256_add_epi16(high[0], high[2]), _mm256_add_epi16(high[6], high[8]));
+            __m256i edges_low = _mm256_add_epi16(_mm256_add_epi16(low[1], low[3]), _mm256_add_epi16(low[5], low[7]));
+            __m256i edges_high = _mm256_add_epi16(_mm256_add_epi16(high[1], high[3]), _mm256_add_epi16(high[5], high[7]));
+            sum_low = add_weighted_avx2(add_weighted_avx2(add_weighted_avx2(sum_low, corners_low, weights[0]), 
+                                                          edges_low, weights[1]), low[4], weights[4]);
+            sum_high = add_weighted_avx2(add_weighted_avx2(add_weighted_avx2(sum_high, corners_high, weights[0]), 
+                                                           edges_high, weights[1]), high[4], weights[4]);
+        }
+        else
+        {
+#pragma GCC unroll 9
+            for (int tap = 0; tap < 9; tap++)
+            {
+                sum_low = add_weighted_avx2(sum_low, low[tap], weights[8 - tap]);
+                sum_high = add_weighted_avx2(sum_high, high[tap], weights[8 - tap]);
+            }
+        }
+
+        __m256i quotient_low = sum_low;
+        __m256i quotient_high = sum_high;
+        unsigned int float_checks = 0;
+
+        if (divisor != 1)
+        {
+            sum_low = _mm256_max_epi16(sum_low, zero);
+            sum_high = _mm256_max_epi16(sum_high, zero);
+            quotient_low = _mm256_mulhi_epu16(sum_low, magic);
+            quotient_high = _mm256_mulhi_epu16(sum_high, magic);
+        }
+
+        if (check)
+        {
+            __m256i exact_low = _mm256_cmpeq_epi16(_mm256_mullo_epi16(quotient_low, divisor_vector), sum_low);
+            __m256i exact_high = _mm256_cmpeq_epi16(_mm256_mullo_epi16(quotient_high, divisor_vector), sum_high);
+            exact_low = _mm256_and_si256(exact_low, _mm256_and_si256(_mm256_cmpgt_epi16(sum_low, zero), _mm256_cmpgt_epi16(limit, sum_low)));
+            exact_high = _mm256_and_si256(exact_high, _mm256_and_si256(_mm256_cmpgt_epi16(sum_high, zero), _mm256_cmpgt_epi16(limit, sum_high)));
+            /**
+             *  The packing works in 128 bit lanes, so the quarters are put back in order
+             **/ 
+            __m256i packed_checks = _mm256_permute4x64_epi64(_mm256_packs_epi16(exact_low, exact_high), 0xD8);
+            float_checks = (unsigned int) _mm256_movemask_epi8(packed_checks);
+        }
+
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(quotient_low, quotient_high), 0xD8);
+        _mm256_storeu_si256((__m256i *) (result_line + position), packed);
+
+        while (float_checks)
+        {
+            int lane = __builtin_ctz(float_checks);
+            result_line[position + lane] = filter_byte_float(lines, position + lane, step, length, current_filter);
+            float_checks &= float_checks - 1;
+        }
+    }
+
+    return position;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The generic kernels, with the weights of the filter known only at run time.
+ **/
+int filter_bytes_sse2(unsigned char **lines, unsigned char *result_line, int position, int end, 
+                      int step, int length, const filter *current_filter)
+{
+    return filter_bytes_sse2_body(lines, result_line, position, end, step, length, current_filter, 
+                                  &current_filter -> weights[0][0], current_filter -> divisor);
+}
+
+__attribute__((target("avx2")))
+int filter_bytes_avx2(unsigned char **lines, unsigned char *result_line, int position, int end, 
+                      int step, int length, const filter *current_filter)
+{
+    return filter_bytes_avx2_body(lines, result_line, position, end, step, length, current_filter, 
+                                  &current_filter -> weights[0][0], current_filter -> divisor);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The specialised kernels of a built-in filter: name##_weights, 
+ *  filter_bytes_sse2_##name and filter_bytes_avx2_##name.
+ **/
+#define DEFINE_FIXED_POINT_KERNELS(name, divisor, ...) \
+    static const short name##_weights[9] = {__VA_ARGS__}; \
+    \
+    int filter_bytes_sse2_##name(unsigned char **lines, unsigned char *result_line, int position, int end, \
+                                 int step, int length, const filter *current_filter) \
+    { \
+        return filter_bytes_sse2_body(lines, result_line, position, end, step, length, current_filter, \
+                                      name##_weights, divisor); \
+    } \
+    \
+    __attribute__((target("avx2"))) \
+    int filter_bytes_avx2_##name(unsigned char **lines, unsigned char *result_line, int position, int end, \
+                                 int step, int length, const filter *current_filter) \
+    { \
+        return filter_bytes_avx2_body(lines, result_line, position, end, step, length, current_filter, \
+                                      name##_weights, divisor); \
+    }
+
+DEFINE_FIXED_POINT_KERNELS(smooth, 9, 1, 1, 1, 1, 1, 1, 1, 1, 1)
+DEFINE_FIXED_POINT_KERNELS(blur, 16, 1, 2, 1, 2, 4, 2, 1, 2, 1)
+DEFINE_FIXED_POINT_KERNELS(sharpen, 3, 0, -2, 0, -2, 11, -2, 0, -2, 0)
+DEFINE_FIXED_POINT_KERNELS(mean, 1, -1, -1, -1, -1, 9, -1, -1, -1, -1)
+DEFINE_FIXED_POINT_KERNELS(emboss, 1, 0, 1, 0, 0, 0, 0, 0, -1, 0)
+DEFINE_FIXED_POINT_KERNELS(identity, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0)
+
+/**
+ *  The dispatch table of the specialised kernels, searched once for every 
+ *  filter of the chain by resolve_fixed_point_kernels.
+ **/ 
+typedef struct
+{
+    const short *weights;
+    int divisor;
+    fixed_point_kernel sse2;
+    fixed_point_kernel avx2;
+
+} specialised_kernels;
+
+const specialised_kernels fixed_point_kernels[] =
+{
+    {smooth_weights, 9, filter_bytes_sse2_smooth, filter_bytes_avx2_smooth},
+    {blur_weights, 16, filter_bytes_sse2_blur, filter_bytes_avx2_blur},
+    {sharpen_weights, 3, filter_bytes_sse2_sharpen, filter_bytes_avx2_sharpen},
+    {mean_weights, 1, filter_bytes_sse2_mean, filter_bytes_avx2_mean},
+    {emboss_weights, 1, filter_bytes_sse2_emboss, filter_bytes_avx2_emboss},
+    {identity_weights, 1, filter_bytes_sse2_identity, filter_bytes_avx2_identity}
+};
+
+#endif
+
+/****************************************************************************************************/
+
+/**
+ *  @param: current_filter
+ * 
+ *  Choose the vector kernels of a filter with an integer form, once, when the
+ *  chain is parsed: the specialised kernels of its weights if there are any 
+ *  (the generic ones otherwise), and the AVX2 one only if the processor 
+ *  supports it.
+ **/
+void resolve_fixed_point_kernels(filter *current_filter)
+{
+    current_filter -> wide_kernel = NULL;
+    current_filter -> narrow_kernel = NULL;
+    if (current_filter -> kind != FILTER_BUILTIN || current_filter -> divisor == 0)
+    {
+        return;
+    }
+
+#if defined(__SSE2__)
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    current_filter -> narrow_kernel = filter_bytes_sse2;
+    current_filter -> wide_kernel = has_avx2 ? filter_bytes_avx2 : NULL;
+
+    for (size_t i = 0; i < sizeof(fixed_point_kernels) / sizeof(fixed_point_kernels[0]); i++)
+    {
+        if (fixed_point_kernels[i].divisor == current_filter -> divisor &&
+            memcmp(fixed_point_kernels[i].weights, current_filter -> weights, sizeof(current_filter -> weights)) == 0)
+        {
+            current_filter -> narrow_kernel = fixed_point_kernels[i].sse2;
+            current_filter -> wide_kernel = has_avx2 ? fixed_point_kernels[i].avx2 : NULL;
+        }
+    }
+#endif
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: lines -> the line above, the current line and the line under it
+ *  @param: result_line
+ *  @param: from
+ *  @param: to -> the bytes [from, to) of the line are computed
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ * 
+ *  Filter a part of a line with the fixed point kernels: the vector kernels
+ *  of the filter (see resolve_fixed_point_kernels) for the interior of the 
+ *  line and the scalar one, which checks the bounds, only for the first and
+ *  the last pixel.
+ **/
+void filter_line_fixed_point(unsigned char **lines, unsigned char *result_line, int from, int to, 
+                             int step, int length, const filter *current_filter)
+{
+    int position = from;
+    int end = to < length - step ? to : length - step;
+
+    for (; position < step && position < to; position++)
+    {
+        result_line[position] = filter_byte_fixed_point(lines, position, step, length, current_filter);
+    }
+
+    if (current_filter -> wide_kernel != NULL)
+    {
+        position = current_filter -> wide_kernel(lines, result_line, position, end, step, length, current_filter);
+    }
+    if (current_filter -> narrow_kernel != NULL)
+    {
+        position = current_filter -> narrow_kernel(lines, result_line, position, end, step, length, current_filter);
+    }
+
+    for (; position < to; position++)
+    {
+        result_line[position] = filter_byte_fixed_point(lines, position, step, length, current_filter);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The following functions are the kernels of the user filters of any size.
+ *  As the fixed point kernels, they see a line as a vector of bytes where the
+ *  neighbour of a byte is step bytes away, so they work for both image types.
+ *  They receive the window of 2 * radius + 1 lines around the filtered line;
+ *  the lines outside the image are zero lines, so they count as zero exactly
+ *  as for the built-in filters. The bounds are checked only for the bytes 
+ *  closer than radius pixels to the ends of the line.
+ **/ 
+
+/**
+ *  @param: value
+ * 
+ *  Clamp a filtered value to [0, 255] and truncate it.
+ **/
+unsigned char clamp_value(float value)
+{
+    if (value > 255) value = 255;
+    if (value < 0) value = 0;
+
+    return (unsigned char) value;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: position
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ * 
+ *  One byte of a dense kernel, checking the bounds of the line.
+ **/
+unsigned char filter_byte_dense(unsigned char **window, int position, int step, int length, const filter *current_filter)
+{
+    int size = current_filter -> size;
+    int radius = size / 2;
+    float result_value = 0.0;
+
+    for (int offset_i = -radius; offset_i <= radius; offset_i++)
+    {
+        unsigned char *line = window[radius + offset_i];
+        const float *kernel_line = current_filter -> kernel + (radius - offset_i) * size;
+
+        for (int offset_j = -radius; offset_j <= radius; offset_j++)
+        {
+            int neighbour = position + offset_j * step;
+            if (neighbour >= 0 && neighbour < length)
+            {
+                result_value += kernel_line[radius - offset_j] * (float) line[neighbour];
+            }
+        }
+    }
+
+    return clamp_value(result_value);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: result_line
+ *  @param: from
+ *  @param: to -> the bytes [from, to) of the line are computed
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ * 
+ *  Dense kernel: size * size multiplications for every byte.
+ **/
+void filter_line_dense(unsigned char **window, unsigned char *result_line, int from, int to, 
+                       int step, int length, const filter *current_filter)
+{
+    int size = current_filter -> size;
+    int radius = size / 2;
+    int interior_from = radius * step;
+    int interior_to = length - radius * step;
+    int position = from;
+
+    for (; position < to && position < interior_from; position++)
+    {
+        result_line[position] = filter_byte_dense(window, position, step, length, current_filter);
+    }
+
+    for (; position < to && position < interior_to; position++)
+    {
+        float result_value = 0.0;
+
+        for (int offset_i = -radius; offset_i <= radius; offset_i++)
+        {
+            unsigned char *line = window[radius + offset_i] + position;
+            const float *kernel_line = current_filter -> kernel + (radius - offset_i) * size + radius;
+
+            for (int offset_j = -radius; offset_j <= radius; offset_j++)
+            {
+                result_value += kernel_line[-offset_j] * (float) line[offset_j * step];
+            }
+        }
+
+        result_line[position] = clamp_value(result_value);
+    }
+
+    for (; position < to; position++)
+    {
+        result_line[position] = filter_byte_dense(window, position, step, length, current_filter);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: result_line
+ *  @param: from
+ *  @param: to -> the bytes [from, to) of the line are computed
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ *  @param: work
+ * 
+ *  Separable kernel: a vertical 1-D pass for the line, kept in floats, followed 
+ *  by a horizontal 1-D pass on it, so 2 * size multiplications for every byte.
+ **/
+void filter_line_separable(unsigned char **window, unsigned char *result_line, int from, int to, 
+                           int step, int length, const filter *current_filter, scratch *work)
+{
+    int radius = current_filter -> size / 2;
+    float *vertical = work -> line;
+    int vertical_from = (int)fmax(from - radius * step, 0);
+    int vertical_to = (int)fmin(to + radius * step, length);
+
+    for (int position = vertical_from; position < vertical_to; position++)
+    {
+        vertical[position] = 0.0;
+    }
+
+    for (int offset_i = -radius; offset_i <= radius; offset_i++)
+    {
+        unsigned char *line = window[radius + offset_i];
+        float value = current_filter -> column_vector[radius - offset_i];
+        for (int position = vertical_from; position < vertical_to; position++)
+        {
+            vertical[position] += value * (float) line[position];
+        }
+    }
+
+    const float *row_vector = current_filter -> row_vector + radius;
+    int interior_from = radius * step;
+    int interior_to = length - radius * step;
+
+    for (int position = from; position < to; position++)
+    {
+        float result_value = 0.0;
+
+        if (position >= interior_from && position < interior_to)
+        {
+            for (int offset_j = -radius; offset_j <= radius; offset_j++)
+            {
+                result_value += row_vector[-offset_j] * vertical[position + offset_j * step];
+            }
+        }
+        else
+        {
+            for (int offset_j = -radius; offset_j <= radius; offset_j++)
+            {
+                int neighbour = position + offset_j * step;
+                if (neighbour >= 0 && neighbour < length)
+                {
+                    result_value += row_vector[-offset_j] * vertical[neighbour];
+                }
+            }
+        }
+
+        result_line[position] = clamp_value(result_value);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: outgoing -> the line just above the window, when restart is 0
+ *  @param: result_line
+ *  @param: from
+ *  @param: to -> the bytes [from, to) of the line are computed
+ *  @param: restart -> 1 if the previous line was not computed by this call sequence
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ *  @param: work
+ * 
+ *  Box kernel with running sums: the sums of the columns are updated with one
+ *  line in and one line out when moving to the next line, and the sum of the
+ *  window with one column in and one out when moving to the next byte, so the
+ *  cost for a byte does not depend on the size of the box.
+ **/
+void filter_line_box(unsigned char **window, unsigned char *outgoing, unsigned char *result_line, int from, int to, 
+                     int restart, int step, int length, const filter *current_filter, scratch *work)
+{
+    int radius = current_filter -> size / 2;
+    float value = current_filter -> kernel[0];
+    int *sums = work -> sums;
+    int sums_from = (int)fmax(from - radius * step, 0);
+    int sums_to = (int)fmin(to + radius * step, length);
+
+    if (restart)
+    {
+        for (int position = sums_from; position < sums_to; position++)
+        {
+            sums[position] = 0;
+        }
+        for (int line = 0; line < 2 * radius + 1; line++)
+        {
+            for (int position = sums_from; position < sums_to; position++)
+            {
+                sums[position] += window[line][position];
+            }
+        }
+    }
+    else
+    {
+        unsigned char *incoming = window[2 * radius];
+        for (int position = sums_from; position < sums_to; position++)
+        {
+            sums[position] += incoming[position] - outgoing[position];
+        }
+    }
+
+    for (int channel = 0; channel < step; channel++)
+    {
+        int sum = 0;
+        for (int position = from + channel - radius * step; position <= from + channel + radius * step; position += step)
+        {
+            if (position >= 0 && position < length)
+            {
+                sum += sums[position];
+            }
+        }
+
+        for (int position = from + channel; position < to; position += step)
+        {
+            result_line[position] = clamp_value(value * (float) sum);
+
+            int in = position + (radius + 1) * step;
+            int out = position - radius * step;
+            if (in < length)
+            {
+                sum += sums[in];
+            }
+            if (out >= 0)
+            {
+                sum -= sums[out];
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The rank filters (median, minimum, maximum, any percentile) with the
+ *  algorithm of Perreault and Hebert: every byte of the line has the histogram
+ *  of its column of the window, updated with one line in and one line out
+ *  when moving to the next line (as the sums of the box kernel), and the
+ *  histogram of the window is updated with one column in and one column out
+ *  when moving to the next byte. The cost of a byte does not depend on the
+ *  radius; the histograms have coarse bins too, so a value is found in at
+ *  most 16 + 16 steps.
+ * 
+ *  Unlike the convolutions, the pixels outside the image are not counted (a
+ *  zero padding would make the minimum of every border black), so near the
+ *  top and the bottom of the image the histograms of the columns are built
+ *  again from the lines of the image.
+ **/ 
+
+/**
+ *  @param: histogram
+ *  @param: column
+ * 
+ *  Add the histogram of a column to the histogram of the window.
+ **/
+static inline void add_histogram(unsigned short *histogram, const unsigned short *column)
+{
+    for (int bin = 0; bin < RANK_HISTOGRAM; bin++)
+    {
+        histogram[bin] += column[bin];
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: histogram
+ *  @param: column
+ * 
+ *  Remove the histogram of a column from the histogram of the window.
+ **/
+static inline void remove_histogram(unsigned short *histogram, const unsigned short *column)
+{
+    for (int bin = 0; bin < RANK_HISTOGRAM; bin++)
+    {
+        histogram[bin] -= column[bin];
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: histogram
+ *  @param: incoming
+ *  @param: outgoing
+ * 
+ *  Move the window by one column: add a column and remove another one in a
+ *  single pass over the histogram.
+ **/
+static inline void slide_histogram(unsigned short *histogram, const unsigned short *incoming, const unsigned short *outgoing)
+{
+    for (int bin = 0; bin < RANK_HISTOGRAM; bin++)
+    {
+        histogram[bin] += incoming[bin] - outgoing[bin];
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: histogram
+ *  @param: rank -> from 0
+ * 
+ *  The value of the given rank in the histogram.
+ **/
+static inline unsigned char find_rank(const unsigned short *histogram, int rank)
+{
+    const unsigned short *coarse = histogram + RANK_BINS;
+    int bin = 0;
+    while (coarse[bin] <= rank)
+    {
+        rank -= coarse[bin];
+        bin++;
+    }
+
+    int value = bin * (RANK_BINS / RANK_COARSE_BINS);
+    while (histogram[value] <= rank)
+    {
+        rank -= histogram[value];
+        value++;
+    }
+
+    return (unsigned char) value;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: outgoing
+ *  @param: result_line
+ *  @param: from
+ *  @param: to
+ *  @param: restart
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ *  @param: work
+ * 
+ *  Rank kernel with the histograms of the columns.
+ **/
+void filter_line_rank(unsigned char **window, unsigned char *outgoing, unsigned char *result_line, int from, int to, 
+                      int restart, int step, int length, const filter *current_filter, scratch *work)
+{
+    int radius = current_filter -> size / 2;
+    unsigned short *columns = work -> histograms;
+    int histograms_from = (int)fmax(from - radius * step, 0);
+    int histograms_to = (int)fmin(to + radius * step, length);
+    int first_line = (int)fmax(radius - work -> above, 0);
+    int last_line = 2 * radius - (int)fmax(radius - work -> below, 0);
+
+    if (restart || work -> above <= radius || work -> below < radius)
+    {
+        memset(columns + (size_t) histograms_from * RANK_HISTOGRAM, 0, 
+               (size_t) (histograms_to - histograms_from) * RANK_HISTOGRAM * sizeof(unsigned short));
+        for (int line = first_line; line <= last_line; line++)
+        {
+            for (int position = histograms_from; position < histograms_to; position++)
+            {
+                unsigned short *column = columns + (size_t) position * RANK_HISTOGRAM;
+                unsigned char value = window[line][position];
+                column[value]++;
+                column[RANK_BINS + value / (RANK_BINS / RANK_COARSE_BINS)]++;
+            }
+        }
+    }
+    else
+    {
+        unsigned char *incoming = window[2 * radius];
+        for (int position = histograms_from; position < histograms_to; position++)
+        {
+            unsigned short *column = columns + (size_t) position * RANK_HISTOGRAM;
+            column[incoming[position]]++;
+            column[RANK_BINS + incoming[position] / (RANK_BINS / RANK_COARSE_BINS)]++;
+            column[outgoing[position]]--;
+            column[RANK_BINS + outgoing[position] / (RANK_BINS / RANK_COARSE_BINS)]--;
+        }
+    }
+
+    int lines = last_line - first_line + 1;
+    unsigned short histogram[RANK_HISTOGRAM];
+    for (int channel = 0; channel < step; channel++)
+    {
+        memset(histogram, 0, sizeof(histogram));
+        int number_of_columns = 0;
+        for (int position = from + channel - radius * step; position <= from + channel + radius * step; position += step)
+        {
+            if (position >= 0 && position < length)
+            {
+                add_histogram(histogram, columns + (size_t) position * RANK_HISTOGRAM);
+                number_of_columns++;
+            }
+        }
+
+        for (int position = from + channel; position < to; position += step)
+        {
+            int count = lines * number_of_columns;
+            result_line[position] = find_rank(histogram, (int) (current_filter -> percentile * (count - 1) / 100 + 0.5f));
+
+            int in = position + (radius + 1) * step;
+            int out = position - radius * step;
+            if (in < length && out >= 0)
+            {
+                slide_histogram(histogram, columns + (size_t) in * RANK_HISTOGRAM, columns + (size_t) out * RANK_HISTOGRAM);
+                continue;
+            }
+            if (in < length)
+            {
+                add_histogram(histogram, columns + (size_t) in * RANK_HISTOGRAM);
+                number_of_columns++;
+            }
+            if (out >= 0)
+            {
+                remove_histogram(histogram, columns + (size_t) out * RANK_HISTOGRAM);
+                number_of_columns--;
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: window
+ *  @param: outgoing
+ *  @param: result_line
+ *  @param: from
+ *  @param: to
+ *  @param: restart
+ *  @param: step
+ *  @param: length
+ *  @param: current_filter
+ *  @param: work
+ * 
+ *  Filter the bytes [from, to) of a line with the kernel of the filter kind.
+ **/
+void filter_line(unsigned char **window, unsigned char *outgoing, unsigned char *result_line, int from, int to, 
+                 int restart, int step, int length, const filter *current_filter, scratch *work)
+{
+    if (current_filter -> kind == FILTER_DENSE)
+    {
+        filter_line_dense(window, result_line, from, to, step, length, current_filter);
+    }
+    else if (current_filter -> kind == FILTER_SEPARABLE)
+    {
+        filter_line_separable(window, result_line, from, to, step, length, current_filter, work);
+    }
+    else if (current_filter -> kind == FILTER_BOX)
+    {
+        filter_line_box(window, outgoing, result_line, from, to, restart, step, length, current_filter, work);
+    }
+    else if (current_filter -> kind == FILTER_RANK)
+    {
+        filter_line_rank(window, outgoing, result_line, from, to, restart, step, length, current_filter, work);
+    }
+    else if (current_filter -> divisor == 0)
+    {
+        for (int position = from; position < to; position++)
+        {
+            result_line[position] = filter_byte_float(window, position, step, length, current_filter);
+        }
+    }
+    else
+    {
+        filter_line_fixed_point(window, result_line, from, to, step, length, current_filter);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The FFT kernels: the convolution with a large dense kernel is done in the
+ *  frequency domain with overlap-save. The region is cut in tiles of rows x
+ *  columns pixels (powers of 2, chosen for the size of the kernel), read 
+ *  with the size - 1 pixels around them; every tile is transformed, multiplied
+ *  by the spectrum of the kernel and transformed back, and only its pixels
+ *  that did not wrap around are kept. Two tiles side by side are transformed
+ *  at once as the real and the imaginary part of the same values, as the 
+ *  kernel is real. The cost of a pixel grows only with log(size).
+ * 
+ *  The result is computed in double precision and truncated as the float path
+ *  of the dense kernels; both are rounded, so a byte may differ by 1 from the
+ *  dense kernel when its exact value is an integer.
+ **/ 
+
+/**
+ *  @param: kernel_size
+ *  @param: extent -> the lines or the bytes of a plane of the region
+ * 
+ *  The size of the tiles in one dimension: the power of 2 (up to 
+ *  MAX_FFT_SIZE) with the lowest cost of the transforms to cover the region,
+ *  as every tile keeps only size - kernel_size + 1 of its values.
+ **/
+int get_fft_size(int kernel_size, int extent)
+{
+    int best = 0;
+    double best_cost = 0;
+
+    for (int size = 2; size <= MAX_FFT_SIZE; size *= 2)
+    {
+        int kept = size - kernel_size + 1;
+        if (kept < 1)
+        {
+            continue;
+        }
+
+        double cost = ceil((1.0 * extent) / kept) * size * log2(size);
+        if (best == 0 || cost < best_cost)
+        {
+            best = size;
+            best_cost = cost;
+        }
+        if (kept >= extent)
+        {
+            break;
+        }
+    }
+
+    return best;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: size -> a power of 2
+ *  @param: twiddles -> size / 2 values
+ *  @param: order -> size values
+ * 
+ *  The twiddle factors and the bit reversed indices of the transforms of size values.
+ **/
+void prepare_fft(int size, double complex *twiddles, int *order)
+{
+    for (int k = 0; k < size / 2; k++)
+    {
+        twiddles[k] = cexp(-2.0 * M_PI * I * k / size);
+    }
+
+    int bits = 0;
+    while ((1 << bits) < size)
+    {
+        bits++;
+    }
+    for (int k = 0; k < size; k++)
+    {
+        int reversed = 0;
+        for (int bit = 0; bit < bits; bit++)
+        {
+            reversed |= ((k >> bit) & 1) << (bits - 1 - bit);
+        }
+        order[k] = reversed;
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: data
+ *  @param: size -> a power of 2
+ *  @param: twiddles
+ *  @param: order
+ *  @param: inverse -> 1 for the inverse transform (not divided by size)
+ * 
+ *  In place radix-2 transform of size values.
+ **/
+void transform(double complex *data, int size, const double complex *twiddles, const int *order, int inverse)
+{
+    for (int k = 0; k < size; k++)
+    {
+        if (k < order[k])
+        {
+            double complex aux = data[k];
+            data[k] = data[order[k]];
+            data[order[k]] = aux;
+        }
+    }
+
+    for (int half = 1; half < size; half *= 2)
+    {
+        int stride = size / (2 * half);
+        for (int start = 0; start < size; start += 2 * half)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                double complex twiddle = inverse ? conj(twiddles[k * stride]) : twiddles[k * stride];
+                double complex odd = data[start + half + k] * twiddle;
+                data[start + half + k] = data[start + k] - odd;
+                data[start + k] += odd;
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: plan
+ *  @param: data -> plan -> rows x plan -> columns values
+ *  @param: inverse
+ *  @param: used_rows -> only the first used_rows lines are not zero (forward transform)
+ * 
+ *  2-D transform: every line, then every column.
+ **/
+void transform_2d(fft_plan *plan, double complex *data, int inverse, int used_rows)
+{
+    int rows = plan -> rows;
+    int columns = plan -> columns;
+
+    for (int row = 0; row < (inverse ? rows : used_rows); row++)
+    {
+        transform(data + (size_t) row * columns, columns, plan -> row_twiddles, plan -> row_order, inverse);
+    }
+
+    for (int column = 0; column < columns; column++)
+    {
+        for (int row = 0; row < rows; row++)
+        {
+            plan -> column[row] = data[(size_t) row * columns + column];
+        }
+        transform(plan -> column, rows, plan -> column_twiddles, plan -> column_order, inverse);
+        for (int row = 0; row < rows; row++)
+        {
+            data[(size_t) row * columns + column] = plan -> column[row];
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: plan
+ *  @param: current_filter
+ *  @param: rows
+ *  @param: columns
+ * 
+ *  Build the transforms of the kernel for tiles of rows x columns values, if
+ *  the plan is not already for that size. The kernel is placed with its 
+ *  center at (0, 0), wrapped around, as the convolution is circular.
+ **/
+void prepare_fft_plan(fft_plan *plan, const filter *current_filter, int rows, int columns)
+{
+    if (plan -> rows == rows && plan -> columns == columns)
+    {
+        return;
+    }
+
+    free(plan -> kernel);
+    free(plan -> tile);
+    free(plan -> column);
+    free(plan -> row_twiddles);
+    free(plan -> column_twiddles);
+    free(plan -> row_order);
+    free(plan -> column_order);
+
+    plan -> rows = rows;
+    plan -> columns = columns;
+    plan -> kernel = (double complex *) calloc((size_t) rows * columns, sizeof(double complex));
+    plan -> tile = (double complex *) malloc((size_t) rows * columns * sizeof(double complex));
+    plan -> column = (double complex *) malloc(rows * sizeof(double complex));
+    plan -> row_twiddles = (double complex *) malloc(columns / 2 * sizeof(double complex));
+    plan -> column_twiddles = (double complex *) malloc(rows / 2 * sizeof(double complex));
+    plan -> row_order = (int *) malloc(columns * sizeof(int));
+    plan -> column_order = (int *) malloc(rows * sizeof(int));
+    prepare_fft(columns, plan -> row_twiddles, plan -> row_order);
+    prepare_fft(rows, plan -> column_twiddles, plan -> column_order);
+
+    int size = current_filter -> size;
+    int radius = size / 2;
+    for (int i = 0; i < size; i++)
+    {
+        for (int j = 0; j < size; j++)
+        {
+            int row = (i - radius + rows) % rows;
+            int column = (j - radius + columns) % columns;
+            plan -> kernel[(size_t) row * columns + column] = current_filter -> kernel[i * size + j] / ((double) rows * columns);
+        }
+    }
+    transform_2d(plan, plan -> kernel, 0, rows);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: plan
+ **/
+void free_fft_plan(fft_plan *plan)
+{
+    free(plan -> kernel);
+    free(plan -> tile);
+    free(plan -> column);
+    free(plan -> row_twiddles);
+    free(plan -> column_twiddles);
+    free(plan -> row_order);
+    free(plan -> column_order);
+    free(plan);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source
+ *  @param: result
+ *  @param: start_line
+ *  @param: end_line
+ *  @param: plane_offset
+ *  @param: length -> the bytes of a plane of a line
+ *  @param: current_filter
+ *  @param: plan
+ * 
+ *  Filter the lines [start_line, end_line) of a plane with an FFT kernel. The
+ *  source must have radius valid lines above and under the region.
+ **/
+void filter_plane_fft(Image *source, Image *result, int start_line, int end_line, int plane_offset, int length,
+                      const filter *current_filter, fft_plan *plan)
+{
+    int radius = current_filter -> size / 2;
+    int size = current_filter -> size;
+    prepare_fft_plan(plan, current_filter, get_fft_size(size, end_line - start_line), get_fft_size(size, (length + 1) / 2));
+
+    int rows = plan -> rows;
+    int columns = plan -> columns;
+    int tile_rows = rows - 2 * radius;
+    int tile_columns = columns - 2 * radius;
+    double complex *tile = plan -> tile;
+
+    for (int first_line = start_line; first_line < end_line; first_line += tile_rows)
+    {
+        int output_rows = (int)fmin(tile_rows, end_line - first_line);
+        int used_rows = (int)fmin(rows, output_rows + 2 * radius);
+
+        for (int first_column = 0; first_column < length; first_column += 2 * tile_columns)
+        {
+            for (int row = 0; row < used_rows; row++)
+            {
+                unsigned char *line = (unsigned char *) get_line(source, first_line - radius + row) + plane_offset;
+                double complex *values = tile + (size_t) row * columns;
+                for (int column = 0; column < columns; column++)
+                {
+                    int real = first_column - radius + column;
+                    int imaginary = real + tile_columns;
+                    values[column] = (real >= 0 && real < length ? line[real] : 0) + 
+                                     I * (imaginary >= 0 && imaginary < length ? line[imaginary] : 0);
+                }
+            }
+            memset(tile + (size_t) used_rows * columns, 0, (size_t) (rows - used_rows) * columns * sizeof(double complex));
+
+            transform_2d(plan, tile, 0, used_rows);
+            for (size_t k = 0; k < (size_t) rows * columns; k++)
+            {
+                tile[k] *= plan -> kernel[k];
+            }
+            transform_2d(plan, tile, 1, rows);
+
+            for (int row = 0; row < output_rows; row++)
+            {
+                unsigned char *line = (unsigned char *) get_line(result, first_line + row) + plane_offset;
+                double complex *values = tile + (size_t) (row + radius) * columns + radius;
+                for (int column = 0; column < tile_columns; column++)
+                {
+                    if (first_column + column < length)
+                    {
+                        line[first_column + column] = clamp_value((float) creal(values[column]));
+                    }
+                    if (first_column + tile_columns + column < length)
+                    {
+                        line[first_column + tile_columns + column] = clamp_value((float) cimag(values[column]));
+                    }
+                }
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The tiled engine. A group of consecutive filters of the chain is applied on a 
+ *  tile of the strip at once (temporal blocking), so that the strip is read and 
+ *  written once for the whole group instead of once for every filter. 
+ * 
+ *  A tile is a block of columns, as wide as it fits in the cache together with
+ *  the lines kept by the group, and all the lines of the region. The lines go 
+ *  through all the filters one by one: every filter (a stage) keeps only the last
+ *  2 * radius + 2 lines that it produced, in a ring, which are the window of the
+ *  next filter (and the line that just left it, for the running sums). Every stage
+ *  computes the columns of the tile plus the halo needed by the stages after it,
+ *  so the halo grows from the last stage to the first one. The lines outside the
+ *  image are never computed, they are zero lines exactly as the padding.
+ **/ 
+
+typedef struct
+{
+    int count;
+    const filter **filters;
+    /**
+     *  Sum of the radii of the stages after a stage, and of all of them
+     **/ 
+    int *remaining;
+    int radius;
+    /**
+     *  Output rings of all the stages but the last one, which writes in the result
+     **/ 
+    int *ring_size;
+    unsigned char **rings;
+    int *last_line;
+    scratch **work;
+    unsigned char *zero_line;
+    unsigned char **window;
+    /**
+     *  A PNM line is filtered in its planar form (see convert_lines): 3 planes
+     *  of plane_length bytes each. The planes are independent, so the group is
+     *  applied on one plane after the other, as on a PGM image.
+     **/ 
+    int planes;
+    int plane_length;
+    int step;
+    int length;
+    int tile_bytes;
+
+} pipeline;
+
+/****************************************************************************************************/
+
+/**
+ *  @param: filters
+ *  @param: count
+ *  @param: type
+ *  @param: width
+ * 
+ *  Prepare the memory of the tiled engine for a group of filters and lines of
+ *  an image. It is done once, before the chain of filters.
+ **/
+pipeline *create_pipeline(filter *filters, int count, int type, int width)
+{
+    pipeline *group = (pipeline *) malloc(sizeof(pipeline));
+    group -> count = count;
+    group -> planes = type == PGM ? 1 : 3;
+    group -> plane_length = width;
+    group -> step = 1;
+    group -> length = group -> planes * width;
+    group -> filters = (const filter **) malloc(count * sizeof(filter *));
+    group -> remaining = (int *) malloc(count * sizeof(int));
+    group -> ring_size = (int *) calloc(count, sizeof(int));
+    group -> rings = (unsigned char **) calloc(count, sizeof(unsigned char *));
+    group -> last_line = (int *) malloc(count * sizeof(int));
+    group -> work = (scratch **) malloc(count * sizeof(scratch *));
+    group -> zero_line = (unsigned char *) calloc(group -> length, sizeof(unsigned char));
+
+    int max_radius = 0;
+    int ring_lines = 0;
+    group -> radius = 0;
+    for (int k = count - 1; k >= 0; k--)
+    {
+        int radius = get_filter_radius(&filters[k]);
+        group -> filters[k] = &filters[k];
+        group -> remaining[k] = group -> radius;
+        group -> radius += radius;
+        max_radius = (int)fmax(max_radius, radius);
+
+        group -> work[k] = (scratch *) malloc(sizeof(scratch));
+        group -> work[k] -> line = (float *) malloc(group -> length * sizeof(float));
+        group -> work[k] -> sums = (int *) malloc(group -> length * sizeof(int));
+        group -> work[k] -> histograms = filters[k].kind != FILTER_RANK ? NULL :
+            (unsigned short *) malloc((size_t) group -> length * RANK_HISTOGRAM * sizeof(unsigned short));
+        group -> work[k] -> fft = filters[k].kind != FILTER_FFT ? NULL : (fft_plan *) calloc(1, sizeof(fft_plan));
+
+        if (k > 0)
+        {
+            group -> ring_size[k - 1] = 2 * radius + 2;
+            group -> rings[k - 1] = (unsigned char *) calloc((size_t) group -> ring_size[k - 1] * group -> length, sizeof(unsigned char));
+            ring_lines += group -> ring_size[k - 1];
+        }
+    }
+    group -> window = (unsigned char **) malloc((2 * max_radius + 1) * sizeof(unsigned char *));
+
+    /**
+     *  The width of a tile in a plane: the rings and the window of the first stage
+     *  should fit in the cache. It is a multiple of 32 bytes, for the vector kernels.
+     **/ 
+    group -> tile_bytes = group -> plane_length;
+    if (count > 1)
+    {
+        int tile_bytes = TILE_CACHE_BYTES / (ring_lines + 2 * max_radius + 2);
+        tile_bytes = (int)fmax(tile_bytes - tile_bytes % 32, 2 * 32);
+        group -> tile_bytes = (int)fmin(tile_bytes, group -> plane_length);
+    }
+
+    return group;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: group
+ **/
+void free_pipeline(pipeline *group)
+{
+    for (int k = 0; k < group -> count; k++)
+    {
+        free(group -> rings[k]);
+        free(group -> work[k] -> line);
+        free(group -> work[k] -> sums);
+        free(group -> work[k] -> histograms);
+        if (group -> work[k] -> fft != NULL)
+        {
+            free_fft_plan(group -> work[k] -> fft);
+        }
+        free(group -> work[k]);
+    }
+
+    free(group -> filters);
+    free(group -> remaining);
+    free(group -> ring_size);
+    free(group -> rings);
+    free(group -> last_line);
+    free(group -> work);
+    free(group -> zero_line);
+    free(group -> window);
+    free(group);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: group
+ *  @param: source
+ *  @param: stage -> -1 for the source image
+ *  @param: line
+ *  @param: global_offset -> the line of the whole image of the first line of source
+ *  @param: image_height
+ * 
+ *  A line produced by a stage (or of the source for stage -1).
+ **/
+unsigned char *get_stage_line(pipeline *group, Image *source, int stage, int line, int global_offset, int image_height)
+{
+    if (stage < 0)
+    {
+        return (unsigned char *) get_line(source, line);
+    }
+
+    if (line + global_offset < 0 || line + global_offset >= image_height)
+    {
+        return group -> zero_line;
+    }
+
+    int slot = line % group -> ring_size[stage];
+    if (slot < 0)
+    {
+        slot += group -> ring_size[stage];
+    }
+
+    return group -> rings[stage] + (size_t) slot * group -> length;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source
+ *  @param: result
+ *  @param: group
+ *  @param: start_line
+ *  @param: end_line
+ *  @param: global_offset -> the line of the whole image of the first line of source
+ *  @param: image_height
+ * 
+ *  Apply a group of filters on the lines [start_line, end_line) of source, 
+ *  writing them in result. The source must have group -> radius valid lines 
+ *  above and under the region (halo lines, zero outside the image). The lines
+ *  outside the region are not touched, so the function can be called several 
+ *  times on the same result for different groups of lines.
+ *  
+ *  At step t, stage k produces the line t + remaining[k]: the last line of its 
+ *  window was produced by the stage before it at the same step.
+ **/
+void apply_filters(Image *source, Image *result, pipeline *group, int start_line, int end_line, 
+                   int global_offset, int image_height)
+{
+    int step = group -> step;
+    int length = group -> plane_length;
+
+    if (start_line >= end_line)
+    {
+        return;
+    }
+
+    /**
+     *  An FFT kernel is always alone in its group and filters whole tiles; the
+     *  lines outside the image are left as they are (zero), as below.
+     **/ 
+    if (group -> filters[0] -> kind == FILTER_FFT)
+    {
+        int first_line = (int)fmax(start_line, -global_offset);
+        int last_line = (int)fmin(end_line, image_height - global_offset);
+        for (int plane = 0; plane < group -> planes && first_line < last_line; plane++)
+        {
+            filter_plane_fft(source, result, first_line, last_line, plane * length, length, group -> filters[0], 
+                             group -> work[0] -> fft);
+        }
+        return;
+    }
+
+    for (int plane = 0; plane < group -> planes; plane++)
+    {
+        int plane_offset = plane * length;
+
+        for (int tile_from = 0; tile_from < length; tile_from += group -> tile_bytes)
+        {
+            int tile_to = (int)fmin(tile_from + group -> tile_bytes, length);
+
+            for (int k = 0; k < group -> count; k++)
+            {
+                group -> last_line[k] = start_line - group -> remaining[k] - 2;
+            }
+
+            for (int t = start_line - 2 * group -> remaining[0]; t < end_line; t++)
+            {
+                for (int k = 0; k < group -> count; k++)
+                {
+                    int remaining = group -> remaining[k];
+                    int line = t + remaining;
+
+                    if (line < start_line - remaining || line >= end_line + remaining ||
+                        line + global_offset < 0 || line + global_offset >= image_height)
+                    {
+                        continue;
+                    }
+
+                    const filter *current_filter = group -> filters[k];
+                    int radius = get_filter_radius(current_filter);
+                    for (int offset_i = -radius; offset_i <= radius; offset_i++)
+                    {
+                        group -> window[radius + offset_i] = plane_offset + 
+                            get_stage_line(group, source, k - 1, line + offset_i, global_offset, image_height);
+                    }
+
+                    int restart = group -> last_line[k] != line - 1;
+                    unsigned char *outgoing = restart ? NULL : plane_offset + 
+                        get_stage_line(group, source, k - 1, line - radius - 1, global_offset, image_height);
+                    group -> last_line[k] = line;
+
+                    unsigned char *result_line = plane_offset + (k == group -> count - 1 ? 
+                                                 (unsigned char *) get_line(result, line) :
+                                                 get_stage_line(group, source, k, line, global_offset, image_height));
+
+                    int from = (int)fmax(tile_from - remaining * step, 0);
+                    int to = (int)fmin(tile_to + remaining * step, length);
+                    scratch plane_work = {group -> work[k] -> line + plane_offset, group -> work[k] -> sums + plane_offset, 
+                                          group -> work[k] -> histograms == NULL ? NULL : 
+                                          group -> work[k] -> histograms + (size_t) plane_offset * RANK_HISTOGRAM,
+                                          line + global_offset, image_height - 1 - line - global_offset};
+                    filter_line(group -> window, outgoing, result_line, from, to, restart, step, length, current_filter, &plane_work);
+                }
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The lines given to a thread of the process by apply_filters_threads
+ **/ 
+typedef struct
+{
+    Image *source;
+    Image *result;
+    pipeline *group;
+    int start_line;
+    int end_line;
+    int global_offset;
+    int image_height;
+
+} filter_task;
+
+/****************************************************************************************************/
+
+/**
+ *  @param: argument -> a filter_task
+ **/
+void *filter_worker(void *argument)
+{
+    filter_task *task = (filter_task *) argument;
+    apply_filters(task -> source, task -> result, task -> group, task -> start_line, task -> end_line,
+                  task -> global_offset, task -> image_height);
+
+    return NULL;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: source
+ *  @param: result
+ *  @param: groups -> one copy of the pipeline of the group for every thread
+ *  @param: number_of_threads
+ *  @param: start_line
+ *  @param: end_line
+ *  @param: global_offset
+ *  @param: image_height
+ * 
+ *  Same as apply_filters, with the lines split in blocks between the threads
+ *  of the process. The calling thread takes the first block and it is the only
+ *  one that calls MPI. A block is not split for less than 2 lines per thread.
+ **/
+void apply_filters_threads(Image *source, Image *result, pipeline **groups, int number_of_threads,
+                           int start_line, int end_line, int global_offset, int image_height)
+{
+    int lines = end_line - start_line;
+    int number_of_blocks = (int)fmax(1, fmin(number_of_threads, lines / 2));
+
+    if (number_of_blocks == 1)
+    {
+        apply_filters(source, result, groups[0], start_line, end_line, global_offset, image_height);
+        return;
+    }
+
+    pthread_t threads[number_of_blocks];
+    filter_task tasks[number_of_blocks];
+
+    for (int t = 0; t < number_of_blocks; t++)
+    {
+        int low_bound;
+        int high_bound;
+        get_strip_bounds(lines, number_of_blocks, t, &low_bound, &high_bound);
+
+        tasks[t].source = source;
+        tasks[t].result = result;
+        tasks[t].group = groups[t];
+        tasks[t].start_line = start_line + low_bound;
+        tasks[t].end_line = start_line + high_bound;
+        tasks[t].global_offset = global_offset;
+        tasks[t].image_height = image_height;
+
+        if (t > 0)
+        {
+            pthread_create(&threads[t], NULL, filter_worker, &tasks[t]);
+        }
+    }
+
+    filter_worker(&tasks[0]);
+
+    for (int t = 1; t < number_of_blocks; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the whole image, only on the master
+ *  @param: header -> type, width, height, max_val
+ *  @param: groups -> the pipelines of the groups, number_of_threads copies of each
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: halo
+ *  @param: line_type
+ * 
+ *  @param: files -> NULL, or the files of the MPI-IO path
+ * 
+ *  Static scheduling: every process keeps its own strip of the image for the 
+ *  whole chain of filters. Before every group only the boundary lines are 
+ *  exchanged with the neighbours and the master gathers the strips once, in
+ *  image. With MPI-IO every process reads and writes its own strip instead.
+ **/
+void filter_strips(Image *image, int header[4], pipeline **groups, int number_of_groups, int number_of_threads,
+                   int halo, MPI_Datatype line_type, parallel_files *files)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+    int height = header[2];
+
+    /**
+   *  Every strip but the last one must have at least halo lines, so that the
+   *  halo of a process comes only from its neighbours. The processes over
+   *  number_of_strips get an empty strip.
+   **/ 
+    int number_of_strips = (int)fmax(1, fmin(number_of_processes, height / halo));
+
+    int low_bound;
+    int high_bound;
+    get_strip_bounds(height, number_of_strips, rank, &low_bound, &high_bound);
+    int rows = high_bound - low_bound;
+
+    /**
+   *  The neighbours of the strip; processes with an empty strip (only at the end
+   *  when there are more processes than strips) do not take part in the exchange.
+   **/ 
+    int next_low_bound;
+    int next_high_bound;
+    get_strip_bounds(height, number_of_strips, rank + 1, &next_low_bound, &next_high_bound);
+    int down_lines = next_high_bound - next_low_bound;
+
+    int up = (rank > 0 && rows > 0) ? rank - 1 : MPI_PROC_NULL;
+    int down = (rank < number_of_processes - 1 && down_lines > 0) ? rank + 1 : MPI_PROC_NULL;
+
+    /**
+   *  Two buffers for the strip, allocated once and used in turns as source and
+   *  destination of the filters, so there is no allocation during the chain.
+   *  The halo lines of both stay zero at the top and the bottom of the image.
+   **/ 
+    Image *strip = allocate_image(header[0], header[1], rows + 2 * halo, header[3]);
+    Image *filtered = allocate_image(header[0], header[1], rows + 2 * halo, header[3]);
+
+    double start = profile_clock();
+    if (files != NULL)
+    {
+        MPI_File_read_at_all(files -> input, files -> input_offset + low_bound * files -> line_bytes, 
+                             get_line(strip, halo), rows, line_type, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+        scatter_image(image, strip, height, number_of_strips, halo, line_type, MPI_COMM_WORLD);
+    }
+    convert_lines(strip, halo, halo + rows, 1);
+    profile_phase(PHASE_DISTRIBUTE, start);
+
+    for (int g = 0; g < number_of_groups; g++) 
+    {
+        if (rows == 0)
+        {
+            continue;
+        }
+
+        pipeline **group = &groups[g * number_of_threads];
+        int radius = group[0] -> radius;
+        int first = halo;
+        int last = halo + rows;
+        int global_offset = low_bound - halo;
+
+        MPI_Request requests[4];
+        start = profile_clock();
+        start_halo_exchange(strip, halo, radius, down_lines, up, down, line_type, requests, MPI_COMM_WORLD);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        /**
+     *  Interior lines first, then the first and the last radius lines of the 
+     *  strip after the halo lines have arrived.
+     **/ 
+        int interior_first = (int)fmin(first + radius, last);
+        int interior_last = (int)fmax(last - radius, interior_first);
+        start = profile_clock();
+        apply_filters_threads(strip, filtered, group, number_of_threads, interior_first, interior_last, global_offset, height);
+        profile_group(g, start);
+
+        start = profile_clock();
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        start = profile_clock();
+        apply_filters_threads(strip, filtered, group, number_of_threads, first, interior_first, global_offset, height);
+        apply_filters_threads(strip, filtered, group, number_of_threads, interior_last, last, global_offset, height);
+        profile_group(g, start);
+
+        Image *aux = strip;
+        strip = filtered;
+        filtered = aux;
+    }
+
+    start = profile_clock();
+    convert_lines(strip, halo, halo + rows, 0);
+    if (files != NULL)
+    {
+        MPI_File_write_at_all(files -> output, files -> output_offset + low_bound * files -> line_bytes, 
+                              get_line(strip, halo), rows, line_type, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+        gather_image(image, strip, height, number_of_strips, halo, line_type, MPI_COMM_WORLD);
+    }
+    profile_phase(PHASE_COLLECT, start);
+
+    free_image(strip);
+    free_image(filtered);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  2-D decomposition (--blocks). The processes are placed in a Cartesian grid
+ *  (MPI_Cart_create) of lines x columns of blocks, as close to square blocks
+ *  as the number of processes allows, so the halo of a block grows with its
+ *  perimeter instead of with the width of the image. Before every group the
+ *  halo columns are exchanged first (with a strided datatype), then the halo
+ *  lines over the whole width of the buffers, so the corners come from the
+ *  diagonal neighbours through the side ones. Then, as for the strips, the
+ *  interior lines are filtered while the halo lines are on their way.
+ * 
+ *  A block is filtered as a small image: the values near its cut sides are 
+ *  wrong, but they move inwards by the radius of every filter, so the block 
+ *  itself is exact as long as its halo is as large as the radius of the group.
+ **/ 
+
+/**
+ *  @param: height
+ *  @param: width
+ *  @param: halo
+ *  @param: number_of_processes
+ *  @param: dims -> the lines and the columns of blocks
+ * 
+ *  Choose the grid with the smallest perimeter of a block, among those with
+ *  all the blocks at least halo lines high and wide. The processes are all 
+ *  used if a grid of them exists, else as many of them as possible.
+ **/
+void choose_grid(int height, int width, int halo, int number_of_processes, int dims[2])
+{
+    dims[0] = 1;
+    dims[1] = 1;
+
+    for (int processes = number_of_processes; processes > 1; processes--)
+    {
+        double best = -1;
+        for (int lines = processes; lines >= 1; lines--)
+        {
+            int columns = processes / lines;
+            if (processes % lines != 0 || lines > height / halo || columns > width / halo)
+            {
+                continue;
+            }
+
+            double perimeter = ceil((1.0 * height) / lines) + ceil((1.0 * width) / columns);
+            if (best < 0 || perimeter < best)
+            {
+                best = perimeter;
+                dims[0] = lines;
+                dims[1] = columns;
+            }
+        }
+
+        if (best >= 0)
+        {
+            return;
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: layout -> grid and dims set
+ *  @param: header
+ *  @param: halo
+ *  @param: grid_rank
+ * 
+ *  Fill the bounds and the neighbours of the block of a process of the grid.
+ *  The lines and the columns are split in parts of almost equal size.
+ **/
+void set_block_bounds(block_layout *layout, int header[4], int halo, int grid_rank)
+{
+    MPI_Cart_coords(layout -> grid, grid_rank, 2, layout -> coords);
+    int line = layout -> coords[0];
+    int column = layout -> coords[1];
+
+    layout -> low_line = (int) ((long long) header[2] * line / layout -> dims[0]);
+    layout -> high_line = (int) ((long long) header[2] * (line + 1) / layout -> dims[0]);
+    layout -> low_column = (int) ((long long) header[1] * column / layout -> dims[1]);
+    layout -> high_column = (int) ((long long) header[1] * (column + 1) / layout -> dims[1]);
+    layout -> left = column > 0 ? halo : 0;
+    layout -> right = column < layout -> dims[1] - 1 ? halo : 0;
+    layout -> width = layout -> left + layout -> high_column - layout -> low_column + layout -> right;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: header
+ *  @param: halo
+ *  @param: layout
+ * 
+ *  Create the grid of the processes and find the block of this process. It
+ *  must be called by all the processes; the ones left out of the grid get
+ *  MPI_COMM_NULL and an empty block.
+ **/
+void create_block_layout(int header[4], int halo, block_layout *layout)
+{
+    int number_of_processes;
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+
+    int periods[2] = {0, 0};
+    choose_grid(header[2], header[1], halo, number_of_processes, layout -> dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 2, layout -> dims, periods, 0, &layout -> grid);
+
+    if (layout -> grid == MPI_COMM_NULL)
+    {
+        layout -> low_line = layout -> high_line = 0;
+        layout -> low_column = layout -> high_column = 0;
+        layout -> left = layout -> right = 0;
+        layout -> width = 1;
+        layout -> up = layout -> down = layout -> west = layout -> east = MPI_PROC_NULL;
+        return;
+    }
+
+    int grid_rank;
+    MPI_Comm_rank(layout -> grid, &grid_rank);
+    set_block_bounds(layout, header, halo, grid_rank);
+    MPI_Cart_shift(layout -> grid, 0, 1, &layout -> up, &layout -> down);
+    MPI_Cart_shift(layout -> grid, 1, 1, &layout -> west, &layout -> east);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: layout
+ *  @param: header
+ *  @param: stride -> the bytes of a line of the memory
+ * 
+ *  The datatype of the pixels of a block in interleaved lines of stride bytes.
+ **/
+MPI_Datatype create_block_type(block_layout *layout, int header[4], int stride)
+{
+    int pixel_bytes = header[0] == PGM ? 1 : 3;
+    MPI_Datatype block_type;
+    MPI_Type_vector(layout -> high_line - layout -> low_line, (layout -> high_column - layout -> low_column) * pixel_bytes,
+                    stride, MPI_UNSIGNED_CHAR, &block_type);
+    MPI_Type_commit(&block_type);
+
+    return block_type;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> only significant on master
+ *  @param: strip -> the buffer of the block
+ *  @param: layout
+ *  @param: header
+ *  @param: halo
+ *  @param: to_blocks -> 1 to send the blocks from image, 0 to collect them in image
+ * 
+ *  Scatter (or gather) the blocks: the master sends every block straight from
+ *  the lines of the image with a strided datatype, without packing it.
+ **/
+void move_blocks(Image *image, Image *strip, block_layout *layout, int header[4], int halo, int to_blocks)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int pixel_bytes = header[0] == PGM ? 1 : 3;
+    int number_of_blocks = layout -> dims[0] * layout -> dims[1];
+
+    MPI_Request *requests = (MPI_Request *) malloc((number_of_blocks + 1) * sizeof(MPI_Request));
+    MPI_Datatype *types = (MPI_Datatype *) malloc((number_of_blocks + 1) * sizeof(MPI_Datatype));
+
+    MPI_Datatype own_type = create_block_type(layout, header, layout -> width * pixel_bytes);
+    unsigned char *own = (unsigned char *) get_line(strip, halo) + layout -> left * pixel_bytes;
+    if (to_blocks)
+    {
+        MPI_Irecv(own, 1, own_type, MASTER, DEFAULT_TAG, layout -> grid, &requests[number_of_blocks]);
+    }
+    else
+    {
+        MPI_Isend(own, 1, own_type, MASTER, DEFAULT_TAG, layout -> grid, &requests[number_of_blocks]);
+    }
+
+    int count = 0;
+    if (rank == MASTER)
+    {
+        block_layout other = *layout;
+        for (int b = 0; b < number_of_blocks; b++)
+        {
+            set_block_bounds(&other, header, halo, b);
+            types[b] = create_block_type(&other, header, header[1] * pixel_bytes);
+            unsigned char *lines = (unsigned char *) get_line(image, other.low_line) + other.low_column * pixel_bytes;
+            if (to_blocks)
+            {
+                MPI_Isend(lines, 1, types[b], b, DEFAULT_TAG, layout -> grid, &requests[b]);
+            }
+            else
+            {
+                MPI_Irecv(lines, 1, types[b], b, DEFAULT_TAG, layout -> grid, &requests[b]);
+            }
+        }
+        count = number_of_blocks;
+    }
+
+    MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+    MPI_Wait(&requests[number_of_blocks], MPI_STATUS_IGNORE);
+
+    for (int b = 0; b < count; b++)
+    {
+        MPI_Type_free(&types[b]);
+    }
+    MPI_Type_free(&own_type);
+    free(types);
+    free(requests);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: file
+ *  @param: offset -> the offset of the pixels in the file
+ *  @param: strip
+ *  @param: layout
+ *  @param: header
+ *  @param: halo
+ *  @param: write -> 0 to read the block, 1 to write it
+ * 
+ *  Read (or write) the block with MPI-IO, through a view of the file on the
+ *  block (a subarray of the image). The processes out of the grid take part
+ *  with no data, as the calls are collective.
+ **/
+void access_block(MPI_File file, MPI_Offset offset, Image *strip, block_layout *layout, int header[4], int halo, int write)
+{
+    int pixel_bytes = header[0] == PGM ? 1 : 3;
+    MPI_Datatype file_type = MPI_UNSIGNED_CHAR;
+    MPI_Datatype memory_type = MPI_UNSIGNED_CHAR;
+    int count = 0;
+
+    if (layout -> grid != MPI_COMM_NULL)
+    {
+        int sizes[2] = {header[2], header[1] * pixel_bytes};
+        int subsizes[2] = {layout -> high_line - layout -> low_line, (layout -> high_column - layout -> low_column) * pixel_bytes};
+        int starts[2] = {layout -> low_line, layout -> low_column * pixel_bytes};
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_UNSIGNED_CHAR, &file_type);
+        MPI_Type_commit(&file_type);
+        memory_type = create_block_type(layout, header, layout -> width * pixel_bytes);
+        count = 1;
+    }
+
+    unsigned char *own = (unsigned char *) get_line(strip, halo) + layout -> left * pixel_bytes;
+    MPI_File_set_view(file, offset, MPI_UNSIGNED_CHAR, file_type, "native", MPI_INFO_NULL);
+    if (write)
+    {
+        MPI_File_write_at_all(file, 0, own, count, memory_type, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+        MPI_File_read_at_all(file, 0, own, count, memory_type, MPI_STATUS_IGNORE);
+    }
+    MPI_File_set_view(file, 0, MPI_UNSIGNED_CHAR, MPI_UNSIGNED_CHAR, "native", MPI_INFO_NULL);
+
+    if (count > 0)
+    {
+        MPI_Type_free(&file_type);
+        MPI_Type_free(&memory_type);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: strip -> the buffer of the block, in planar form
+ *  @param: layout
+ *  @param: halo
+ *  @param: radius
+ *  @param: planes
+ * 
+ *  Exchange radius halo columns with the west and the east neighbours, for
+ *  the lines of the block. In planar form every plane of a line is a segment of
+ *  layout -> width bytes, so the columns are a single vector of segments.
+ **/
+void exchange_block_columns(Image *strip, block_layout *layout, int halo, int radius, int planes)
+{
+    int rows = strip -> height - 2 * halo;
+    int columns = layout -> high_column - layout -> low_column;
+    unsigned char *lines = (unsigned char *) get_line(strip, halo);
+
+    MPI_Datatype column_type;
+    MPI_Type_vector(rows * planes, radius, layout -> width, MPI_UNSIGNED_CHAR, &column_type);
+    MPI_Type_commit(&column_type);
+
+    MPI_Request requests[4];
+    MPI_Irecv(lines + layout -> left - radius, 1, column_type, layout -> west, DEFAULT_TAG, layout -> grid, &requests[0]);
+    MPI_Irecv(lines + layout -> left + columns, 1, column_type, layout -> east, DEFAULT_TAG, layout -> grid, &requests[1]);
+    MPI_Isend(lines + layout -> left, 1, column_type, layout -> west, DEFAULT_TAG, layout -> grid, &requests[2]);
+    MPI_Isend(lines + layout -> left + columns - radius, 1, column_type, layout -> east, DEFAULT_TAG, layout -> grid, &requests[3]);
+    MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+    MPI_Type_free(&column_type);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the whole image, only on the master
+ *  @param: header -> type, width, height, max_val
+ *  @param: groups -> the pipelines of the groups, created for lines of layout -> width pixels
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: halo
+ *  @param: layout -> created by create_block_layout
+ *  @param: files -> NULL, or the files of the MPI-IO path
+ * 
+ *  Static scheduling on the blocks of the 2-D decomposition, as filter_strips.
+ **/
+void filter_blocks(Image *image, int header[4], pipeline **groups, int number_of_groups, int number_of_threads,
+                   int halo, block_layout *layout, parallel_files *files)
+{
+    int height = header[2];
+    int planes = header[0] == PGM ? 1 : 3;
+    int rows = layout -> high_line - layout -> low_line;
+
+    Image *strip = allocate_image(header[0], layout -> width, rows + 2 * halo, header[3]);
+    Image *filtered = allocate_image(header[0], layout -> width, rows + 2 * halo, header[3]);
+    MPI_Datatype line_type = create_line_type(header[0], layout -> width);
+
+    double start = profile_clock();
+    if (files != NULL)
+    {
+        access_block(files -> input, files -> input_offset, strip, layout, header, halo, 0);
+    }
+    else if (layout -> grid != MPI_COMM_NULL)
+    {
+        move_blocks(image, strip, layout, header, halo, 1);
+    }
+    convert_lines(strip, halo, halo + rows, 1);
+    profile_phase(PHASE_DISTRIBUTE, start);
+
+    for (int g = 0; g < number_of_groups && rows > 0; g++) 
+    {
+        pipeline **group = &groups[g * number_of_threads];
+        int radius = group[0] -> radius;
+        int first = halo;
+        int last = halo + rows;
+        int global_offset = layout -> low_line - halo;
+
+        /**
+     *  The columns first, so that the lines sent next carry the corners.
+     **/ 
+        MPI_Request requests[4];
+        start = profile_clock();
+        exchange_block_columns(strip, layout, halo, radius, planes);
+        start_halo_exchange(strip, halo, radius, radius, layout -> up, layout -> down, line_type, requests, layout -> grid);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        int interior_first = (int)fmin(first + radius, last);
+        int interior_last = (int)fmax(last - radius, interior_first);
+        start = profile_clock();
+        apply_filters_threads(strip, filtered, group, number_of_threads, interior_first, interior_last, global_offset, height);
+        profile_group(g, start);
+
+        start = profile_clock();
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        start = profile_clock();
+        apply_filters_threads(strip, filtered, group, number_of_threads, first, interior_first, global_offset, height);
+        apply_filters_threads(strip, filtered, group, number_of_threads, interior_last, last, global_offset, height);
+        profile_group(g, start);
+
+        Image *aux = strip;
+        strip = filtered;
+        filtered = aux;
+    }
+
+    start = profile_clock();
+    convert_lines(strip, halo, halo + rows, 0);
+    if (files != NULL)
+    {
+        access_block(files -> output, files -> output_offset, strip, layout, header, halo, 1);
+    }
+    else if (layout -> grid != MPI_COMM_NULL)
+    {
+        move_blocks(image, strip, layout, header, halo, 0);
+    }
+    profile_phase(PHASE_COLLECT, start);
+
+    if (layout -> grid != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&layout -> grid);
+    }
+    MPI_Type_free(&line_type);
+    free_image(strip);
+    free_image(filtered);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the source and the result image, only on the master (NULL with MPI-IO)
+ *  @param: header -> type, width, height, max_val
+ *  @param: groups -> the pipelines of the groups, number_of_threads copies of each
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: halo
+ *  @param: line_type
+ *  @param: files -> NULL, or the files of the MPI-IO path
+ * 
+ *  Shared memory scheduling: the static strips are given to the nodes instead
+ *  of the processes. The two buffers of the strip of a node are allocated once
+ *  in the memory shared by its processes, so a node holds only two copies of
+ *  its lines and nothing is copied between its processes. Every process of the
+ *  node filters its own share of the strip from one buffer in the other, with
+ *  a barrier of the node after every group. Only the first process of every 
+ *  node (its leader) talks to the other nodes: it receives the strip of the 
+ *  node, exchanges the halo lines with the leaders of the neighbour nodes and
+ *  sends back the result. With MPI-IO every process reads and writes its share.
+ **/
+void filter_shared(Image *image, int header[4], pipeline **groups, int number_of_groups, int number_of_threads,
+                   int halo, MPI_Datatype line_type, parallel_files *files)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int height = header[2];
+
+    MPI_Comm node;
+    MPI_Comm leaders;
+    int node_rank;
+    int node_size;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_size(node, &node_size);
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leaders);
+
+    /**
+     *  The index of the node and the number of nodes, known by the leaders
+     **/ 
+    int nodes[2];
+    if (node_rank == 0)
+    {
+        MPI_Comm_rank(leaders, &nodes[0]);
+        MPI_Comm_size(leaders, &nodes[1]);
+    }
+    MPI_Bcast(nodes, 2, MPI_INT, 0, node);
+    int node_index = nodes[0];
+    int number_of_nodes = nodes[1];
+
+    /**
+     *  The strips of the nodes are laid out as the strips of the processes in
+     *  filter_strips, on the communicator of the leaders.
+     **/ 
+    int number_of_strips = (int)fmax(1, fmin(number_of_nodes, height / halo));
+
+    int low_bound;
+    int high_bound;
+    get_strip_bounds(height, number_of_strips, node_index, &low_bound, &high_bound);
+    int rows = high_bound - low_bound;
+
+    int next_low_bound;
+    int next_high_bound;
+    get_strip_bounds(height, number_of_strips, node_index + 1, &next_low_bound, &next_high_bound);
+    int down_lines = next_high_bound - next_low_bound;
+
+    int up = (node_index > 0 && rows > 0) ? node_index - 1 : MPI_PROC_NULL;
+    int down = (node_index < number_of_nodes - 1 && down_lines > 0) ? node_index + 1 : MPI_PROC_NULL;
+
+    MPI_Win windows[2];
+    Image *strip = allocate_shared_image(header[0], header[1], rows + 2 * halo, header[3], node, &windows[0]);
+    Image *filtered = allocate_shared_image(header[0], header[1], rows + 2 * halo, header[3], node, &windows[1]);
+
+    /**
+     *  The share of the process in the lines of the strip, for the conversions and MPI-IO
+     **/ 
+    int share_low;
+    int share_high;
+    get_strip_bounds(rows, node_size, node_rank, &share_low, &share_high);
+
+    double start = profile_clock();
+    if (files != NULL)
+    {
+        MPI_File_read_at_all(files -> input, files -> input_offset + (low_bound + share_low) * files -> line_bytes, 
+                             get_line(strip, halo + share_low), share_high - share_low, line_type, MPI_STATUS_IGNORE);
+    }
+    else if (node_rank == 0)
+    {
+        scatter_image(image, strip, height, number_of_strips, halo, line_type, leaders);
+    }
+    synchronize_node(windows, node);
+    convert_lines(strip, halo + share_low, halo + share_high, 1);
+    synchronize_node(windows, node);
+    profile_phase(PHASE_DISTRIBUTE, start);
+
+    for (int g = 0; g < number_of_groups; g++) 
+    {
+        if (rows == 0)
+        {
+            continue;
+        }
+
+        pipeline **group = &groups[g * number_of_threads];
+        int radius = group[0] -> radius;
+        int first = halo;
+        int last = halo + rows;
+        int global_offset = low_bound - halo;
+
+        MPI_Request requests[4];
+        if (node_rank == 0)
+        {
+            start_halo_exchange(strip, halo, radius, down_lines, up, down, line_type, requests, leaders);
+        }
+
+        /**
+         *  The interior lines are split between the processes of the node while
+         *  the halo lines are in flight; then the first process of the node 
+         *  filters the first radius lines and the last one the last radius lines.
+         **/ 
+        int interior_first = (int)fmin(first + radius, last);
+        int interior_last = (int)fmax(last - radius, interior_first);
+        int share_first;
+        int share_last;
+        get_strip_bounds(interior_last - interior_first, node_size, node_rank, &share_first, &share_last);
+
+        start = profile_clock();
+        apply_filters_threads(strip, filtered, group, number_of_threads, interior_first + share_first, 
+                              interior_first + share_last, global_offset, height);
+        profile_group(g, start);
+
+        start = profile_clock();
+        if (node_rank == 0)
+        {
+            MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+        }
+        synchronize_node(windows, node);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        start = profile_clock();
+        if (node_rank == 0)
+        {
+            apply_filters_threads(strip, filtered, group, number_of_threads, first, interior_first, global_offset, height);
+        }
+        if (node_rank == node_size - 1)
+        {
+            apply_filters_threads(strip, filtered, group, number_of_threads, interior_last, last, global_offset, height);
+        }
+        profile_group(g, start);
+
+        start = profile_clock();
+        synchronize_node(windows, node);
+        profile_phase(PHASE_HALO_WAIT, start);
+
+        Image *aux = strip;
+        strip = filtered;
+        filtered = aux;
+        MPI_Win window = windows[0];
+        windows[0] = windows[1];
+        windows[1] = window;
+    }
+
+    start = profile_clock();
+    convert_lines(strip, halo + share_low, halo + share_high, 0);
+    if (files != NULL)
+    {
+        MPI_File_write_at_all(files -> output, files -> output_offset + (low_bound + share_low) * files -> line_bytes, 
+                              get_line(strip, halo + share_low), share_high - share_low, line_type, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+        synchronize_node(windows, node);
+        if (node_rank == 0)
+        {
+            gather_image(image, strip, height, number_of_strips, halo, line_type, leaders);
+        }
+    }
+    profile_phase(PHASE_COLLECT, start);
+
+    free_shared_image(strip, &windows[0]);
+    free_shared_image(filtered, &windows[1]);
+    if (leaders != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&leaders);
+    }
+    MPI_Comm_free(&node);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: buffers
+ *  @param: low_bound
+ *  @param: high_bound
+ *  @param: total_radius
+ *  @param: height
+ * 
+ *  Line 0 of the buffers of a chunk [low_bound, high_bound) is the line 
+ *  low_bound - total_radius of the image; the lines outside the image must be
+ *  zero in both buffers before the chunk is filtered.
+ **/
+void clear_chunk(Image *buffers[2], int low_bound, int high_bound, int total_radius, int height)
+{
+    int global_offset = low_bound - total_radius;
+    int first = (int)fmax(0, global_offset) - global_offset;
+    int last = (int)fmin(height, high_bound + total_radius) - global_offset;
+    int lines = high_bound - low_bound + 2 * total_radius;
+    int line_bytes = (buffers[0] -> type == PGM ? 1 : 3) * buffers[0] -> width;
+
+    for (int b = 0; b < 2; b++)
+    {
+        for (int line = 0; line < lines; line++)
+        {
+            if (line < first || line >= last)
+            {
+                memset(get_line(buffers[b], line), 0, line_bytes);
+            }
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: buffers -> the lines of the image are in the first one
+ *  @param: low_bound
+ *  @param: high_bound
+ *  @param: header
+ *  @param: groups
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: total_radius
+ * 
+ *  Apply the whole chain on a chunk, with the halo of the whole chain. Group g 
+ *  filters the chunk together with the lines still needed by the groups after
+ *  it, so the halo of the chunk shrinks with every group. Returns the buffer of
+ *  the result, whose line total_radius is the line low_bound of the image.
+ **/
+int filter_chunk(Image *buffers[2], int low_bound, int high_bound, int header[4], pipeline **groups, 
+                 int number_of_groups, int number_of_threads, int total_radius)
+{
+    int height = header[2];
+    int rows = high_bound - low_bound;
+    int global_offset = low_bound - total_radius;
+    int first = (int)fmax(0, global_offset) - global_offset;
+    int last = (int)fmin(height, high_bound + total_radius) - global_offset;
+
+    convert_lines(buffers[0], first, last, 1);
+
+    int source = 0;
+    int remaining = total_radius;
+    for (int g = 0; g < number_of_groups; g++)
+    {
+        pipeline **group = &groups[g * number_of_threads];
+        remaining -= group[0] -> radius;
+        double start = profile_clock();
+        apply_filters_threads(buffers[source], buffers[1 - source], group, number_of_threads,
+                              total_radius - remaining, total_radius + rows + remaining, global_offset, height);
+        profile_group(g, start);
+        source = 1 - source;
+    }
+
+    convert_lines(buffers[source], total_radius, total_radius + rows, 0);
+    return source;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Dynamic scheduling. The master does not filter: it only hands out chunks of
+ *  lines to the workers on demand and receives the results directly in the 
+ *  final image. A worker applies the whole chain of filters on its chunk, so it
+ *  receives the chunk together with total_radius lines above and under it (the
+ *  halo of the whole chain) and never talks to the other workers. 
+ * 
+ *  The size of a chunk is guided by the lines left (the chunks get smaller to 
+ *  the end of the image, so all the workers end at about the same time) and
+ *  weighted by the throughput measured for the worker on its previous chunks,
+ *  so a slow worker gets less lines than a fast one.
+ **/ 
+
+/**
+ *  @param: speed -> lines per second of every worker, 0 if not known yet
+ *  @param: number_of_processes
+ *  @param: worker
+ *  @param: lines_left
+ *  @param: min_chunk
+ **/
+int get_chunk_size(double *speed, int number_of_processes, int worker, int lines_left, int min_chunk)
+{
+    int number_of_workers = number_of_processes - 1;
+    double size = ceil((double) lines_left / (2 * number_of_workers));
+
+    double total_speed = 0.0;
+    int known = 0;
+    for (int i = 1; i < number_of_processes; i++)
+    {
+        if (speed[i] > 0)
+        {
+            total_speed += speed[i];
+            known++;
+        }
+    }
+
+    if (speed[worker] > 0)
+    {
+        size = size * speed[worker] * known / total_speed;
+    }
+
+    return (int)fmin(fmax(size, min_chunk), lines_left);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> NULL with MPI-IO, when the worker reads the lines itself
+ *  @param: height
+ *  @param: worker
+ *  @param: next_line -> the first line not given yet, updated
+ *  @param: size
+ *  @param: total_radius
+ *  @param: line_type
+ * 
+ *  Send to a worker the chunk [next_line, next_line + size) with its halo lines. 
+ *  An empty chunk tells the worker to stop. Returns 1 if a chunk was sent.
+ **/
+int send_chunk(Image *image, int height, int worker, int *next_line, int size, int total_radius, MPI_Datatype line_type)
+{
+    int chunk[2] = {*next_line, (int)fmin(*next_line + size, height)};
+    MPI_Send(chunk, 2, MPI_INT, worker, CHUNK_TAG, MPI_COMM_WORLD);
+
+    if (chunk[0] >= chunk[1])
+    {
+        return 0;
+    }
+
+    if (image != NULL)
+    {
+        int first = (int)fmax(0, chunk[0] - total_radius);
+        int last = (int)fmin(height, chunk[1] + total_radius);
+        if (transport.enabled)
+        {
+            send_lines(image, first, last - first, worker, DEFAULT_TAG, MPI_COMM_WORLD);
+        }
+        else
+        {
+            MPI_Send(get_line(image, first), last - first, line_type, worker, DEFAULT_TAG, MPI_COMM_WORLD);
+        }
+    }
+
+    *next_line = chunk[1];
+    return 1;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> NULL with MPI-IO
+ *  @param: height
+ *  @param: total_radius
+ *  @param: line_type
+ * 
+ *  The master of the dynamic scheduling; returns the filtered image and frees
+ *  the source one. With MPI-IO the workers read and write the lines themselves,
+ *  so the master only hands out the chunks and returns NULL.
+ **/
+Image *filter_dynamic_master(Image *image, int height, int total_radius, MPI_Datatype line_type)
+{
+    int number_of_processes;
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+
+    Image *result = NULL;
+    if (image != NULL)
+    {
+        result = allocate_image(image -> type, image -> width, image -> height, image -> max_val);
+    }
+    double *speed = (double *) calloc(number_of_processes, sizeof(double));
+    int min_chunk = (int)fmax(MIN_CHUNK_LINES, 4 * total_radius);
+    int next_line = 0;
+    int active = 0;
+
+    double start = profile_clock();
+    for (int worker = 1; worker < number_of_processes; worker++)
+    {
+        int size = get_chunk_size(speed, number_of_processes, worker, height - next_line, min_chunk);
+        active += send_chunk(image, height, worker, &next_line, size, total_radius, line_type);
+    }
+    profile_phase(PHASE_DISTRIBUTE, start);
+
+    while (active > 0)
+    {
+        /**
+         *  The report of a worker: first line, end line and the seconds spent
+         **/ 
+        double report[3];
+        MPI_Status status;
+        start = profile_clock();
+        MPI_Recv(report, 3, MPI_DOUBLE, MPI_ANY_SOURCE, REPORT_TAG, MPI_COMM_WORLD, &status);
+
+        int worker = status.MPI_SOURCE;
+        int low_bound = (int) report[0];
+        int high_bound = (int) report[1];
+        if (result != NULL && transport.enabled)
+        {
+            receive_lines(result, low_bound, high_bound - low_bound, worker, DEFAULT_TAG, MPI_COMM_WORLD);
+        }
+        else if (result != NULL)
+        {
+            MPI_Recv(get_line(result, low_bound), high_bound - low_bound, line_type, worker, DEFAULT_TAG, 
+                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        profile_phase(PHASE_COLLECT, start);
+
+        if (report[2] > 0)
+        {
+            speed[worker] = (high_bound - low_bound) / report[2];
+        }
+
+        int size = get_chunk_size(speed, number_of_processes, worker, height - next_line, min_chunk);
+        start = profile_clock();
+        if (!send_chunk(image, height, worker, &next_line, size, total_radius, line_type))
+        {
+            active--;
+        }
+        profile_phase(PHASE_DISTRIBUTE, start);
+    }
+
+    free(speed);
+    if (image != NULL)
+    {
+        free_image(image);
+    }
+    return result;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: header -> type, width, height, max_val
+ *  @param: groups -> the pipelines of the groups, number_of_threads copies of each
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: total_radius
+ *  @param: line_type
+ *  @param: files -> NULL, or the files of the MPI-IO path
+ * 
+ *  A worker of the dynamic scheduling. The two buffers of the chunk grow only
+ *  when a larger chunk arrives.
+ **/
+void filter_dynamic_worker(int header[4], pipeline **groups, int number_of_groups, int number_of_threads,
+                           int total_radius, MPI_Datatype line_type, parallel_files *files)
+{
+    int height = header[2];
+    int capacity = 0;
+    Image *buffers[2] = {NULL, NULL};
+
+    while (1)
+    {
+        int chunk[2];
+        double start = profile_clock();
+        MPI_Recv(chunk, 2, MPI_INT, MASTER, CHUNK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (chunk[0] >= chunk[1])
+        {
+            profile_phase(PHASE_DISTRIBUTE, start);
+            break;
+        }
+
+        int rows = chunk[1] - chunk[0];
+        int lines = rows + 2 * total_radius;
+        if (lines > capacity)
+        {
+            if (capacity > 0)
+            {
+                free_image(buffers[0]);
+                free_image(buffers[1]);
+            }
+            buffers[0] = allocate_image(header[0], header[1], lines, header[3]);
+            buffers[1] = allocate_image(header[0], header[1], lines, header[3]);
+            capacity = lines;
+        }
+
+        clear_chunk(buffers, chunk[0], chunk[1], total_radius, height);
+        int global_offset = chunk[0] - total_radius;
+        int first = (int)fmax(0, global_offset) - global_offset;
+        int last = (int)fmin(height, chunk[1] + total_radius) - global_offset;
+
+        if (files != NULL)
+        {
+            MPI_File_read_at(files -> input, files -> input_offset + (global_offset + first) * files -> line_bytes,
+                             get_line(buffers[0], first), last - first, line_type, MPI_STATUS_IGNORE);
+        }
+        else if (transport.enabled)
+        {
+            receive_lines(buffers[0], first, last - first, MASTER, DEFAULT_TAG, MPI_COMM_WORLD);
+        }
+        else
+        {
+            MPI_Recv(get_line(buffers[0], first), last - first, line_type, MASTER, DEFAULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        profile_phase(PHASE_DISTRIBUTE, start);
+
+        double start_time = MPI_Wtime();
+        int source = filter_chunk(buffers, chunk[0], chunk[1], header, groups, number_of_groups, number_of_threads, total_radius);
+
+        double report[3] = {chunk[0], chunk[1], MPI_Wtime() - start_time};
+        start = profile_clock();
+        if (files != NULL)
+        {
+            MPI_File_write_at(files -> output, files -> output_offset + chunk[0] * files -> line_bytes,
+                              get_line(buffers[source], total_radius), rows, line_type, MPI_STATUS_IGNORE);
+            MPI_Send(report, 3, MPI_DOUBLE, MASTER, REPORT_TAG, MPI_COMM_WORLD);
+        }
+        else
+        {
+            MPI_Send(report, 3, MPI_DOUBLE, MASTER, REPORT_TAG, MPI_COMM_WORLD);
+            if (transport.enabled)
+            {
+                send_lines(buffers[source], total_radius, rows, MASTER, DEFAULT_TAG, MPI_COMM_WORLD);
+            }
+            else
+            {
+                MPI_Send(get_line(buffers[source], total_radius), rows, line_type, MASTER, DEFAULT_TAG, MPI_COMM_WORLD);
+            }
+        }
+        profile_phase(PHASE_COLLECT, start);
+    }
+
+    if (capacity > 0)
+    {
+        free_image(buffers[0]);
+        free_image(buffers[1]);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Streaming (out of core). The image is cut in strips of strip_lines lines, 
+ *  given to the processes in turns (strip s to process s % P). A process reads
+ *  every strip with the halo of the whole chain from the input file, applies 
+ *  the whole chain on it (as a chunk of the dynamic scheduling) and writes it 
+ *  in the output file, so neither the master nor the workers ever hold the 
+ *  image: the memory depends only on the width, strip_lines and the chain.
+ * 
+ *  The I/O is asynchronous and double buffered: there are two pairs of 
+ *  buffers; while a strip is filtered in one pair, the next strip is read in
+ *  the other one, after the write of the previous strip from it has ended.
+ **/ 
+
+/**
+ *  @param: buffers -> a pair of buffers of the strip
+ *  @param: low_bound
+ *  @param: high_bound
+ *  @param: total_radius
+ *  @param: height
+ *  @param: line_type
+ *  @param: files
+ *  @param: request
+ * 
+ *  Start the read of a strip with its halo lines.
+ **/
+void start_strip_read(Image *buffers[2], int low_bound, int high_bound, int total_radius, int height,
+                      MPI_Datatype line_type, parallel_files *files, MPI_Request *request)
+{
+    clear_chunk(buffers, low_bound, high_bound, total_radius, height);
+
+    int global_offset = low_bound - total_radius;
+    int first = (int)fmax(0, global_offset) - global_offset;
+    int last = (int)fmin(height, high_bound + total_radius) - global_offset;
+    MPI_File_iread_at(files -> input, files -> input_offset + (global_offset + first) * files -> line_bytes,
+                      get_line(buffers[0], first), last - first, line_type, request);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: header -> type, width, height, max_val
+ *  @param: groups -> the pipelines of the groups, number_of_threads copies of each
+ *  @param: number_of_groups
+ *  @param: number_of_threads
+ *  @param: total_radius
+ *  @param: strip_lines
+ *  @param: line_type
+ *  @param: files
+ **/
+void filter_stream(int header[4], pipeline **groups, int number_of_groups, int number_of_threads,
+                   int total_radius, int strip_lines, MPI_Datatype line_type, parallel_files *files)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+
+    int height = header[2];
+    int number_of_strips = (height + strip_lines - 1) / strip_lines;
+    if (rank >= number_of_strips)
+    {
+        return;
+    }
+
+    Image *buffers[2][2];
+    for (int pair = 0; pair < 2; pair++)
+    {
+        for (int b = 0; b < 2; b++)
+        {
+            buffers[pair][b] = allocate_image(header[0], header[1], strip_lines + 2 * total_radius, header[3]);
+        }
+    }
+    MPI_Request reads[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    MPI_Request writes[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+
+    start_strip_read(buffers[0], rank * strip_lines, (int)fmin(height, (rank + 1) * strip_lines), total_radius, height,
+                     line_type, files, &reads[0]);
+
+    for (int strip = rank, i = 0; strip < number_of_strips; strip += number_of_processes, i++)
+    {
+        int pair = i % 2;
+        double start = profile_clock();
+        MPI_Wait(&reads[pair], MPI_STATUS_IGNORE);
+        profile_phase(PHASE_DISTRIBUTE, start);
+
+        int next = strip + number_of_processes;
+        if (next < number_of_strips)
+        {
+            start = profile_clock();
+            MPI_Wait(&writes[1 - pair], MPI_STATUS_IGNORE);
+            profile_phase(PHASE_COLLECT, start);
+            start = profile_clock();
+            start_strip_read(buffers[1 - pair], next * strip_lines, (int)fmin(height, (next + 1) * strip_lines), total_radius, 
+                             height, line_type, files, &reads[1 - pair]);
+            profile_phase(PHASE_DISTRIBUTE, start);
+        }
+
+        int low_bound = strip * strip_lines;
+        int high_bound = (int)fmin(height, low_bound + strip_lines);
+        int result = filter_chunk(buffers[pair], low_bound, high_bound, header, groups, number_of_groups, 
+                                  number_of_threads, total_radius);
+
+        start = profile_clock();
+        MPI_File_iwrite_at(files -> output, files -> output_offset + low_bound * files -> line_bytes,
+                           get_line(buffers[pair][result], total_radius), high_bound - low_bound, line_type, &writes[pair]);
+        profile_phase(PHASE_COLLECT, start);
+    }
+
+    double start = profile_clock();
+    MPI_Waitall(2, writes, MPI_STATUSES_IGNORE);
+    profile_phase(PHASE_COLLECT, start);
+
+    for (int pair = 0; pair < 2; pair++)
+    {
+        for (int b = 0; b < 2; b++)
+        {
+            free_image(buffers[pair][b]);
+        }
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the source image, only on the master (NULL with MPI-IO)
+ *  @param: header -> type, width, height, max_val
+ *  @param: specifications -> the filters, as given in the command line
+ *  @param: number_of_filters
+ *  @param: options
+ *  @param: files -> NULL, or the files of the MPI-IO path (always used for streaming)
+ * 
+ *  Apply a chain of filters on an image, on all the processes. Returns on the
+ *  master the filtered image, to be written (NULL with MPI-IO); the source 
+ *  image is either filtered in place or released.
+ **/
+Image *filter_image(Image *image, int header[4], char **specifications, int number_of_filters, 
+                    run_options *options, parallel_files *files)
+{
+    int rank;
+    int number_of_processes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+    int number_of_threads = options -> number_of_threads;
+
+    /**
+     *  The chain of filters is resolved once and split in groups of consecutive
+     *  filters applied together by the tiled engine; the halo of the strips is 
+     *  the largest radius of a group.
+     **/ 
+    filter *chain = (filter *) malloc(number_of_filters * sizeof(filter));
+    for (int i = 0; i < number_of_filters; i++)
+    {
+        chain[i] = parse_filter(specifications[i]);
+        resolve_fixed_point_kernels(&chain[i]);
+    }
+
+    int number_of_groups = 0;
+    int *group_start = (int *) malloc((number_of_filters + 1) * sizeof(int));
+    int halo = 1;
+    int total_radius = 0;
+    for (int i = 0; i < number_of_filters; )
+    {
+        int group_radius = get_filter_radius(&chain[i]);
+        int j = i + 1;
+        while (j < number_of_filters && group_radius + get_filter_radius(&chain[j]) <= TEMPORAL_BLOCKING_RADIUS &&
+               chain[i].kind != FILTER_FFT && chain[j].kind != FILTER_FFT)
+        {
+            group_radius += get_filter_radius(&chain[j]);
+            j++;
+        }
+
+        group_start[number_of_groups++] = i;
+        halo = (int)fmax(halo, group_radius);
+        total_radius += group_radius;
+        i = j;
+    }
+    group_start[number_of_groups] = number_of_filters;
+    profile_groups(specifications, group_start, number_of_groups);
+
+    MPI_Datatype line_type = create_line_type(header[0], header[1]);
+
+    /**
+     *  With the 2-D decomposition the lines of the pipelines are the lines of
+     *  the buffers of the block, with their halo columns.
+     **/ 
+    block_layout layout;
+    int line_width = header[1];
+    int blocks = options -> blocks && options -> stream_lines == 0 && !(options -> dynamic && number_of_processes > 1) &&
+                 !options -> shared;
+    if (blocks)
+    {
+        create_block_layout(header, halo, &layout);
+        line_width = layout.width;
+    }
+
+    /**
+     *  Every thread has its own copy of the pipelines: groups[g * number_of_threads + t]
+     **/ 
+    pipeline **groups = (pipeline **) malloc(number_of_groups * number_of_threads * sizeof(pipeline *));
+    for (int g = 0; g < number_of_groups; g++)
+    {
+        for (int t = 0; t < number_of_threads; t++)
+        {
+            groups[g * number_of_threads + t] = create_pipeline(&chain[group_start[g]], group_start[g + 1] - group_start[g], 
+                                                                header[0], line_width);
+        }
+    }
+
+    /**
+     *  The dynamic scheduling needs at least one worker besides the master.
+     **/ 
+    if (options -> stream_lines > 0)
+    {
+        filter_stream(header, groups, number_of_groups, number_of_threads, total_radius, options -> stream_lines, 
+                      line_type, files);
+    }
+    else if (options -> dynamic && number_of_processes > 1)
+    {
+        if (rank == MASTER)
+        {
+            image = filter_dynamic_master(image, header[2], total_radius, line_type);
+        }
+        else
+        {
+            filter_dynamic_worker(header, groups, number_of_groups, number_of_threads, total_radius, line_type, files);
+        }
+    }
+    else if (options -> shared)
+    {
+        filter_shared(image, header, groups, number_of_groups, number_of_threads, halo, line_type, files);
+    }
+    else if (blocks)
+    {
+        filter_blocks(image, header, groups, number_of_groups, number_of_threads, halo, &layout, files);
+    }
+    else
+    {
+        filter_strips(image, header, groups, number_of_groups, number_of_threads, halo, line_type, files);
+    }
+
+    for (int i = 0; i < number_of_filters; i++)
+    {
+        free(chain[i].kernel);
+        free(chain[i].column_vector);
+        free(chain[i].row_vector);
+    }
+    for (int g = 0; g < number_of_groups * number_of_threads; g++)
+    {
+        free_pipeline(groups[g]);
+    }
+    free(groups);
+    free(group_start);
+    free(chain);
+    MPI_Type_free(&line_type);
+
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Region of interest and incremental filtering. A pixel of the result of the
+ *  chain depends only on the pixels of the input at most total_radius (the sum
+ *  of the radii of the chain) lines and columns away. So a rectangle of the 
+ *  result is computed exactly by filtering the rectangle grown by total_radius
+ *  (clipped to the image, where the padding is the same as for the whole 
+ *  image): the wrong values at the cut edges move inwards by the radius of 
+ *  every filter and never reach the rectangle. After a change of the input in
+ *  a rectangle, only the rectangle grown by total_radius changes in the result.
+ **/ 
+
+/**
+ *  @param: specifications
+ *  @param: number_of_filters
+ * 
+ *  The sum of the radii of the filters of the chain.
+ **/
+int get_chain_radius(char **specifications, int number_of_filters)
+{
+    int total_radius = 0;
+    for (int i = 0; i < number_of_filters; i++)
+    {
+        filter current_filter = parse_filter(specifications[i]);
+        total_radius += get_filter_radius(&current_filter);
+        free(current_filter.kernel);
+        free(current_filter.column_vector);
+        free(current_filter.row_vector);
+    }
+
+    return total_radius;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: area
+ *  @param: margin
+ *  @param: width
+ *  @param: height
+ * 
+ *  The rectangle grown by margin on every side, clipped to the image.
+ **/
+rectangle grow_rectangle(rectangle area, int margin, int width, int height)
+{
+    rectangle grown;
+    grown.x = (int)fmax(0, area.x - margin);
+    grown.y = (int)fmax(0, area.y - margin);
+    grown.width = (int)fmin(width, area.x + area.width + margin) - grown.x;
+    grown.height = (int)fmin(height, area.y + area.height + margin) - grown.y;
+
+    return grown;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: text -> x,y,width,height
+ *  @param: area
+ * 
+ *  Returns 0 if the text is not a valid rectangle.
+ **/
+int parse_rectangle(char *text, rectangle *area)
+{
+    return sscanf(text, "%d,%d,%d,%d", &area -> x, &area -> y, &area -> width, &area -> height) == 4 &&
+           area -> x >= 0 && area -> y >= 0 && area -> width > 0 && area -> height > 0;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: destination
+ *  @param: source
+ *  @param: area -> the rectangle copied, in the coordinates of destination
+ *  @param: x -> the column of destination of the first column of source
+ *  @param: y -> the line of destination of the first line of source
+ **/
+void copy_rectangle(Image *destination, Image *source, rectangle area, int x, int y)
+{
+    int pixel_bytes = destination -> type == PGM ? 1 : 3;
+    for (int line = area.y; line < area.y + area.height; line++)
+    {
+        memcpy((unsigned char *) get_line(destination, line) + area.x * pixel_bytes,
+               (unsigned char *) get_line(source, line - y) + (area.x - x) * pixel_bytes,
+               (size_t) area.width * pixel_bytes);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the whole input image, only on the master; it is not changed
+ *  @param: header -> type, width, height, max_val of the whole image
+ *  @param: area -> the rectangle of the result to compute
+ *  @param: specifications
+ *  @param: number_of_filters
+ *  @param: total_radius
+ *  @param: options
+ * 
+ *  Filter only a rectangle of the image, on all the processes. Returns on the 
+ *  master the rectangle of the result, as an image of its size.
+ **/
+Image *filter_region(Image *image, int header[4], rectangle area, char **specifications, int number_of_filters, 
+                     int total_radius, run_options *options)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    rectangle grown = grow_rectangle(area, total_radius, header[1], header[2]);
+    int grown_header[4] = {header[0], grown.width, grown.height, header[3]};
+
+    Image *crop = NULL;
+    if (rank == MASTER)
+    {
+        crop = allocate_image(header[0], grown.width, grown.height, header[3]);
+        copy_rectangle(crop, image, (rectangle) {0, 0, grown.width, grown.height}, -grown.x, -grown.y);
+    }
+
+    crop = filter_image(crop, grown_header, specifications, number_of_filters, options, NULL);
+
+    Image *result = NULL;
+    if (rank == MASTER)
+    {
+        result = allocate_image(header[0], area.width, area.height, header[3]);
+        copy_rectangle(result, crop, (rectangle) {0, 0, area.width, area.height}, grown.x - area.x, grown.y - area.y);
+        free_image(crop);
+    }
+
+    return result;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: previous -> the previous input
+ *  @param: current -> the current input, of the same size and type
+ *  @param: number_of_rectangles
+ * 
+ *  The rectangles of the pixels that differ between the two inputs: the 
+ *  bounding box of the changes of every band of DIRTY_BAND_LINES lines. 
+ **/
+rectangle *find_dirty_rectangles(Image *previous, Image *current, int *number_of_rectangles)
+{
+    int pixel_bytes = current -> type == PGM ? 1 : 3;
+    int number_of_bands = (current -> height + DIRTY_BAND_LINES - 1) / DIRTY_BAND_LINES;
+    rectangle *rectangles = (rectangle *) malloc((number_of_bands > 0 ? number_of_bands : 1) * sizeof(rectangle));
+    *number_of_rectangles = 0;
+
+    for (int band = 0; band < number_of_bands; band++)
+    {
+        int first_column = current -> width;
+        int last_column = -1;
+        int first_line = -1;
+        int last_line = -1;
+
+        for (int line = band * DIRTY_BAND_LINES; line < current -> height && line < (band + 1) * DIRTY_BAND_LINES; line++)
+        {
+            unsigned char *previous_line = (unsigned char *) get_line(previous, line);
+            unsigned char *current_line = (unsigned char *) get_line(current, line);
+            int bytes = current -> width * pixel_bytes;
+            if (memcmp(previous_line, current_line, bytes) == 0)
+            {
+                continue;
+            }
+
+            int first = 0;
+            while (previous_line[first] == current_line[first])
+            {
+                first++;
+            }
+            int last = bytes - 1;
+            while (previous_line[last] == current_line[last])
+            {
+                last--;
+            }
+
+            first_column = (int)fmin(first_column, first / pixel_bytes);
+            last_column = (int)fmax(last_column, last / pixel_bytes);
+            if (first_line < 0)
+            {
+                first_line = line;
+            }
+            last_line = line;
+        }
+
+        if (first_line >= 0)
+        {
+            rectangles[*number_of_rectangles].x = first_column;
+            rectangles[*number_of_rectangles].y = first_line;
+            rectangles[*number_of_rectangles].width = last_column - first_column + 1;
+            rectangles[*number_of_rectangles].height = last_line - first_line + 1;
+            (*number_of_rectangles)++;
+        }
+    }
+
+    return rectangles;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: image -> the current input, only on the master; it is released
+ *  @param: header -> type, width, height, max_val
+ *  @param: specifications
+ *  @param: number_of_filters
+ *  @param: options
+ * 
+ *  Incremental filtering: the result is the previous output in which only the
+ *  dirty rectangles, grown by total_radius, are computed again. Returns the 
+ *  result on the master.
+ **/
+Image *filter_incremental(Image *image, int header[4], char **specifications, int number_of_filters, 
+                          run_options *options)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    int total_radius = get_chain_radius(specifications, number_of_filters);
+
+    Image *result = NULL;
+    int number_of_rectangles = options -> number_of_dirty;
+    rectangle *rectangles = options -> dirty;
+
+    if (rank == MASTER)
+    {
+        result = read_image(options -> previous_output);
+        if (result -> type != header[0] || result -> width != header[1] || result -> height != header[2])
+        {
+            printf("The previous output %s has not the size and the type of the input\n", options -> previous_output);
+            exit(1);
+        }
+
+        if (number_of_rectangles == 0)
+        {
+            Image *previous = read_image(options -> previous_input);
+            if (previous -> type != header[0] || previous -> width != header[1] || previous -> height != header[2])
+            {
+                printf("The previous input %s has not the size and the type of the input\n", options -> previous_input);
+                exit(1);
+            }
+            rectangles = find_dirty_rectangles(previous, image, &number_of_rectangles);
+            free_image(previous);
+        }
+    }
+
+    /**
+     *  The dirty rectangles found by the master are sent to all the processes
+     **/ 
+    if (options -> number_of_dirty == 0)
+    {
+        MPI_Bcast(&number_of_rectangles, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+        if (rank != MASTER)
+        {
+            rectangles = (rectangle *) malloc((number_of_rectangles > 0 ? number_of_rectangles : 1) * sizeof(rectangle));
+        }
+        MPI_Bcast(rectangles, 4 * number_of_rectangles, MPI_INT, MASTER, MPI_COMM_WORLD);
+    }
+
+    for (int i = 0; i < number_of_rectangles; i++)
+    {
+        rectangle area = grow_rectangle(rectangles[i], total_radius, header[1], header[2]);
+        if (area.width <= 0 || area.height <= 0)
+        {
+            continue;
+        }
+
+        Image *part = filter_region(image, header, area, specifications, number_of_filters, total_radius, options);
+        if (rank == MASTER)
+        {
+            copy_rectangle(result, part, area, area.x, area.y);
+            free_image(part);
+        }
+    }
+
+    if (rank == MASTER)
+    {
+        printf("\t\n%d dirty rectangles filtered again\n", number_of_rectangles);
+        free_image(image);
+    }
+    if (options -> number_of_dirty == 0)
+    {
+        free(rectangles);
+    }
+
+    return result;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Batch mode: a manifest with one image per line, "image_in image_out filter_1
+ *  filter_2 ...", is processed by the same processes. Empty lines and lines that
+ *  start with # are skipped. While image k is filtered, the master reads image
+ *  k + 1 and writes image k - 1 in two other threads, so the processes wait 
+ *  only for the filters (the I/O threads never call MPI).
+ **/ 
+
+typedef struct
+{
+    int count;
+    char **arguments;
+
+} batch_entry;
+
+typedef struct
+{
+    char *file_name;
+    Image *image;
+
+} image_job;
+
+/****************************************************************************************************/
+
+/**
+ *  @param: argument -> an image_job; the image is read in it
+ * 
+ *  The pages of the mapping are touched, so that the image is really loaded
+ *  while the previous one is filtered.
+ **/
+void *read_worker(void *argument)
+{
+    image_job *job = (image_job *) argument;
+    job -> image = read_image(job -> file_name);
+
+    volatile unsigned char *data = (volatile unsigned char *) job -> image -> mapping;
+    for (size_t position = 0; position < job -> image -> mapping_size; position += 4096)
+    {
+        data[position];
+    }
+
+    return NULL;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: argument -> an image_job; the image is written and released
+ **/
+void *write_worker(void *argument)
+{
+    image_job *job = (image_job *) argument;
+    write_image(job -> image, job -> file_name);
+    free_image(job -> image);
+
+    return NULL;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: text -> the manifest, changed in place (the arguments point in it)
+ *  @param: number_of_entries
+ * 
+ *  Split the manifest in entries; the lines with less than 3 arguments are skipped.
+ **/
+batch_entry *parse_manifest(char *text, int *number_of_entries)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    int capacity = 16;
+    batch_entry *entries = (batch_entry *) malloc(capacity * sizeof(batch_entry));
+    *number_of_entries = 0;
+
+    char *line_context;
+    for (char *line = strtok_r(text, "\n", &line_context); line != NULL; line = strtok_r(NULL, "\n", &line_context))
+    {
+        int count = 0;
+        char **arguments = (char **) malloc((strlen(line) / 2 + 1) * sizeof(char *));
+
+        char *context;
+        for (char *word = strtok_r(line, " \t\r", &context); word != NULL; word = strtok_r(NULL, " \t\r", &context))
+        {
+            if (count == 0 && word[0] == '#')
+            {
+                break;
+            }
+            arguments[count++] = word;
+        }
+
+        if (count == 0)
+        {
+            free(arguments);
+            continue;
+        }
+
+        if (count < 3)
+        {
+            if (rank == MASTER)
+            {
+                printf("\n\t Skipped the manifest entry of %s: it needs image_in image_out filter_1 ...\n", arguments[0]);
+            }
+            free(arguments);
+            continue;
+        }
+
+        if (*number_of_entries == capacity)
+        {
+            capacity *= 2;
+            entries = (batch_entry *) realloc(entries, capacity * sizeof(batch_entry));
+        }
+        entries[*number_of_entries].count = count;
+        entries[*number_of_entries].arguments = arguments;
+        (*number_of_entries)++;
+    }
+
+    return entries;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: text -> the text of the master, NULL on the other processes
+ *  @param: length -> the length of the text on the master; a negative length
+ *                    is only broadcast (a stop signal) and NULL is returned
+ * 
+ *  Broadcast a text (a manifest) from the master; returns the text on all 
+ *  the processes, ended by a zero byte.
+ **/
+char *broadcast_text(char *text, long long length)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    MPI_Bcast(&length, 1, MPI_LONG_LONG, MASTER, MPI_COMM_WORLD);
+    if (length < 0)
+    {
+        return NULL;
+    }
+
+    char *result = (char *) malloc(length + 1);
+    if (rank == MASTER)
+    {
+        memcpy(result, text, length);
+    }
+    MPI_Bcast(result, length, MPI_CHAR, MASTER, MPI_COMM_WORLD);
+    result[length] = '\0';
+
+    return result;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: entries
+ *  @param: number_of_entries
+ *  @param: options
+ * 
+ *  Process the images of a manifest, on all the processes.
+ **/
+void process_entries(batch_entry *entries, int number_of_entries, run_options *options)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    image_job read_job;
+    image_job write_job;
+    pthread_t reader;
+    pthread_t writer;
+    int writing = 0;
+
+    if (rank == MASTER && !options -> mpiio && options -> stream_lines == 0 && number_of_entries > 0)
+    {
+        read_job.file_name = entries[0].arguments[0];
+        pthread_create(&reader, NULL, read_worker, &read_job);
+    }
+
+    for (int k = 0; k < number_of_entries; k++)
+    {
+        char **arguments = entries[k].arguments;
+        int header[4];
+
+        if (options -> mpiio || options -> stream_lines > 0)
+        {
+            parallel_files files;
+            double start = profile_clock();
+            open_parallel_files(arguments[0], arguments[1], header, &files);
+            profile_phase(PHASE_READ, start);
+            filter_image(NULL, header, arguments + 2, entries[k].count - 2, options, &files);
+            start = profile_clock();
+            close_parallel_files(&files);
+            profile_phase(PHASE_WRITE, start);
+            if (rank == MASTER)
+            {
+                printf("\t\nThe result image has been writen in the current folder: %s\n", arguments[1]);
+            }
+            continue;
+        }
+
+        Image *image = NULL;
+        if (rank == MASTER)
+        {
+            /**
+             *  The read and write phases of the master are the time it waits for
+             *  its I/O threads.
+             **/ 
+            double start = profile_clock();
+            pthread_join(reader, NULL);
+            profile_phase(PHASE_READ, start);
+            image = read_job.image;
+            if (k + 1 < number_of_entries)
+            {
+                read_job.file_name = entries[k + 1].arguments[0];
+                pthread_create(&reader, NULL, read_worker, &read_job);
+            }
+
+            header[0] = image -> type;
+            header[1] = image -> width;
+            header[2] = image -> height;
+            header[3] = image -> max_val;
+        }
+        MPI_Bcast(header, 4, MPI_INT, MASTER, MPI_COMM_WORLD);
+
+        image = filter_image(image, header, arguments + 2, entries[k].count - 2, options, NULL);
+
+        if (rank == MASTER)
+        {
+            double start = profile_clock();
+            if (writing)
+            {
+                pthread_join(writer, NULL);
+            }
+            profile_phase(PHASE_WRITE, start);
+            write_job.file_name = arguments[1];
+            write_job.image = image;
+            pthread_create(&writer, NULL, write_worker, &write_job);
+            writing = 1;
+        }
+    }
+
+    double start = profile_clock();
+    if (writing)
+    {
+        pthread_join(writer, NULL);
+    }
+    profile_phase(PHASE_WRITE, start);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: entries
+ *  @param: number_of_entries
+ **/
+void free_entries(batch_entry *entries, int number_of_entries)
+{
+    for (int k = 0; k < number_of_entries; k++)
+    {
+        free(entries[k].arguments);
+    }
+    free(entries);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: options
+ * 
+ *  Process all the images of the manifest. The master reads the manifest and
+ *  broadcasts it, so every process knows all the chains of filters.
+ **/
+void run_batch(run_options *options)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    long long length = 0;
+    char *manifest = NULL;
+    size_t size = 0;
+    unsigned char *data = NULL;
+    if (rank == MASTER)
+    {
+        data = map_file(options -> manifest, &size);
+        length = size;
+        manifest = (char *) data;
+    }
+    char *text = broadcast_text(manifest, length);
+    if (rank == MASTER)
+    {
+        munmap(data, size > 0 ? size : 1);
+    }
+
+    int number_of_entries;
+    batch_entry *entries = parse_manifest(text, &number_of_entries);
+    process_entries(entries, number_of_entries, options);
+
+    free_entries(entries, number_of_entries);
+    free(text);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  Service mode (--serve socket): the processes stay up and the master accepts
+ *  requests on a UNIX socket. A request is a connection that sends one or more
+ *  lines "image_in image_out filter_1 filter_2 ..." (the lines of a manifest)
+ *  and closes its writing side; it gets back one line, "ok N seconds" with the
+ *  number of images written, or "error message" (see check_request). The line
+ *  "shutdown" stops the service after the requests already queued.
+ * 
+ *  A thread of the master (which never calls MPI) accepts the connections and
+ *  queues their requests. Every time the processes are free, the master takes
+ *  all the queued requests and handles them as a single batch, so many small
+ *  images are read, filtered and written in a pipeline (see Batch mode).
+ **/ 
+
+typedef struct
+{
+    int connection;
+    char *text;
+
+} service_request;
+
+typedef struct
+{
+    int listener;
+    int wakeup[2];
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    service_request *requests;
+    int number_of_requests;
+    int capacity;
+
+} service_queue;
+
+/****************************************************************************************************/
+
+/**
+ *  @param: connection
+ *  @param: message
+ * 
+ *  Send the answer of a request and close its connection.
+ **/
+void answer_request(int connection, char *message)
+{
+    size_t length = strlen(message);
+    for (size_t written = 0; written < length; )
+    {
+        ssize_t count = write(connection, message + written, length - written);
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+    close(connection);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: text -> the lines of a request
+ * 
+ *  A request is a shutdown when its first word is exactly "shutdown".
+ **/
+int is_shutdown_request(const char *text)
+{
+    const char *word = text + strspn(text, " \t\r\n");
+    return strncmp(word, "shutdown", 8) == 0 && (word[8] == '\0' || strchr(" \t\r\n", word[8]) != NULL);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: name
+ *  @param: error -> MAX_ERROR_BYTES for the reason of an error
+ * 
+ *  Check that an input image can be read: a valid synthetic specification, or
+ *  a file with a valid header and all its pixels. Returns 0 or -1.
+ **/
+int check_input(char *name, char *error)
+{
+    int header[4];
+    if (strncmp(name, "synthetic:", 10) == 0)
+    {
+        if (parse_synthetic(name + 10, header) < 0)
+        {
+            snprintf(error, MAX_ERROR_BYTES, "%s: invalid synthetic image", name);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t size;
+    size_t offset;
+    const char *reason;
+    unsigned char *data = try_map_file(name, &size, &reason);
+    if (data != NULL)
+    {
+        reason = check_header(data, size, header, &offset);
+        munmap(data, size > 0 ? size : 1);
+    }
+    if (reason != NULL)
+    {
+        snprintf(error, MAX_ERROR_BYTES, "%s: %s", name, reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: name
+ *  @param: error
+ * 
+ *  Check that an output image can be written: the file if it exists, else its
+ *  directory. Returns 0 or -1.
+ **/
+int check_output(char *name, char *error)
+{
+    int writable;
+    if (access(name, F_OK) == 0)
+    {
+        writable = access(name, W_OK) == 0;
+    }
+    else
+    {
+        char directory[PATH_MAX];
+        snprintf(directory, sizeof(directory), "%s", name);
+        char *slash = strrchr(directory, '/');
+        if (slash == NULL)
+        {
+            strcpy(directory, ".");
+        }
+        else
+        {
+            slash[slash == directory ? 1 : 0] = '\0';
+        }
+        writable = access(directory, W_OK) == 0;
+    }
+
+    if (!writable)
+    {
+        snprintf(error, MAX_ERROR_BYTES, "%s: The file can't be written!", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: text -> the lines of a request
+ *  @param: error -> MAX_ERROR_BYTES for the reason of an error
+ * 
+ *  Check a request before it is queued: every process stops on a wrong input
+ *  image, output image or filter, so they are all checked on the master and a
+ *  wrong request is answered with an error instead of stopping the service.
+ *  Returns 0, or -1 for the first problem found.
+ **/
+int check_request(char *text, char *error)
+{
+    char *copy = strdup(text);
+    int status = 0;
+    int number_of_entries = 0;
+
+    char *line_context;
+    for (char *line = strtok_r(copy, "\n", &line_context); line != NULL && status == 0; 
+         line = strtok_r(NULL, "\n", &line_context))
+    {
+        int count = 0;
+        char *first = NULL;
+        char *context;
+        for (char *word = strtok_r(line, " \t\r", &context); word != NULL && status == 0; word = strtok_r(NULL, " \t\r", &context))
+        {
+            if (count == 0 && word[0] == '#')
+            {
+                break;
+            }
+
+            if (count == 0)
+            {
+                first = word;
+                status = check_input(word, error);
+            }
+            else if (count == 1)
+            {
+                status = check_output(word, error);
+            }
+            else
+            {
+                filter current_filter;
+                status = try_parse_filter(word, &current_filter, error);
+                if (status == 0)
+                {
+                    free(current_filter.kernel);
+                    free(current_filter.column_vector);
+                    free(current_filter.row_vector);
+                }
+            }
+            count++;
+        }
+
+        if (status == 0 && count > 0 && count < 3)
+        {
+            snprintf(error, MAX_ERROR_BYTES, "%s: the line needs image_in image_out filter_1 ...", first);
+            status = -1;
+        }
+        number_of_entries += count > 0;
+    }
+
+    if (status == 0 && number_of_entries == 0)
+    {
+        snprintf(error, MAX_ERROR_BYTES, "empty request");
+        status = -1;
+    }
+
+    free(copy);
+    return status;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  A connection whose request is still being read by accept_worker
+ **/ 
+typedef struct
+{
+    int connection;
+    char *text;
+    size_t length;
+    long long deadline;
+
+} open_request;
+
+/****************************************************************************************************/
+
+/**
+ *  @param: request
+ *  @param: message
  * 
- *  Basically I allocate a copy of the image that I receive from the input and 
- *  then I modify it according to the rule explained poorly in the PDF :)
+ *  Answer a request that is still being read, without queueing it. What the
+ *  client has already sent is discarded first, so it gets the answer and not
+ *  a reset of the connection.
+ **/
+void refuse_request(open_request *request, char *message)
+{
+    while (recv(request -> connection, request -> text, MAX_REQUEST_BYTES, MSG_DONTWAIT) > 0)
+    {
+    }
+    answer_request(request -> connection, message);
+    free(request -> text);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  The time in milliseconds, for the timeouts of the connections.
+ **/
+long long get_milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: queue
+ *  @param: request -> its text is owned by the queue from now on
  * 
+ *  Check a request that has been read and queue it for the processes, or
+ *  answer it with an error.
+ **/
+void queue_request(service_queue *queue, open_request *request)
+{
+    char *text = request -> text;
+    text[request -> length] = '\0';
+
+    char error[MAX_ERROR_BYTES];
+    if (!is_shutdown_request(text) && check_request(text, error) < 0)
+    {
+        char message[MAX_ERROR_BYTES + 8];
+        snprintf(message, sizeof(message), "error %s\n", error);
+        answer_request(request -> connection, message);
+        free(text);
+        return;
+    }
+
+    pthread_mutex_lock(&queue -> lock);
+    if (queue -> number_of_requests == queue -> capacity)
+    {
+        queue -> capacity *= 2;
+        queue -> requests = (service_request *) realloc(queue -> requests, queue -> capacity * sizeof(service_request));
+    }
+    queue -> requests[queue -> number_of_requests].connection = request -> connection;
+    queue -> requests[queue -> number_of_requests].text = text;
+    queue -> number_of_requests++;
+    pthread_cond_signal(&queue -> ready);
+    pthread_mutex_unlock(&queue -> lock);
+}
+
+/****************************************************************************************************/
+
+/**
+ *  @param: argument -> the service_queue
  * 
+ *  The thread that accepts the connections and reads their requests, all at
+ *  the same time (with poll), so a slow client does not delay the others. A
+ *  request is complete when the client closes its side; it is then checked
+ *  and queued for the processes. A request that reaches MAX_REQUEST_BYTES or 
+ *  gets nothing for REQUEST_TIMEOUT_MS may be cut, so it is answered with an
+ *  error. A byte on the wakeup pipe stops the thread, and the requests still
+ *  being read are answered that the service has been shut down.
  **/
-Image *apply_filter(Image *img, filter current_filter, int start_line, int end_line) {
-  
-  Image *result = malloc(sizeof(Image));
-  
-  unsigned char **r = (unsigned char **) malloc(img -> height * sizeof(unsigned char *));
-  for (int i = 0; i < img -> height; i++)
-  {
-      r[i] = (unsigned char *) malloc(img -> width * sizeof(unsigned char));
-  }
+void *accept_worker(void *argument)
+{
+    service_queue *queue = (service_queue *) argument;
+    int capacity = 16;
+    int number_of_reading = 0;
+    open_request *reading = (open_request *) malloc(capacity * sizeof(open_request));
+    struct pollfd *events = (struct pollfd *) malloc((capacity + 2) * sizeof(struct pollfd));
 
-  pixel **r_color = (pixel **) malloc(img -> height * sizeof(pixel *));
-  for (int i = 0; i < img -> height; i++)
-  {
-      r_color[i] = (pixel *) malloc(img -> width * sizeof(pixel));
-  }
-  
-  if (img -> type == PGM) {
-        for ( int i = 0; i < img -> height; i++)
+    while (1)
+    {
+        long long now = get_milliseconds();
+        int timeout = -1;
+        events[0].fd = queue -> listener;
+        events[0].events = POLLIN;
+        events[1].fd = queue -> wakeup[0];
+        events[1].events = POLLIN;
+        for (int i = 0; i < number_of_reading; i++)
         {
-            for (int j = 0; j < img -> width; j++)
-            {
-                r[i][j] = img -> image[i][j];
-            }
-            
+            events[i + 2].fd = reading[i].connection;
+            events[i + 2].events = POLLIN;
+            int left = (int)fmax(0, reading[i].deadline - now);
+            timeout = timeout < 0 ? left : (int)fmin(timeout, left);
         }
-    result -> image = r;
-  }
-  else
-  {
-       for ( int i = 0; i < img -> height; i++)
+
+        if (poll(events, number_of_reading + 2, timeout) < 0)
+        {
+            continue;
+        }
+        now = get_milliseconds();
+
+        if (events[1].revents != 0)
         {
-            for (int j = 0; j < img -> width; j++)
+            break;
+        }
+
+        /**
+         *  The requests are read first, as the new connections are added at the end.
+         **/ 
+        for (int i = number_of_reading - 1; i >= 0; i--)
+        {
+            char *error = now >= reading[i].deadline ? "error the request timed out\n" : NULL;
+            int complete = 0;
+            if (events[i + 2].revents != 0)
             {
-                r_color[i][j] = img -> color_image[i][j];
+                ssize_t count = read(reading[i].connection, reading[i].text + reading[i].length, MAX_REQUEST_BYTES - reading[i].length);
+                if (count > 0)
+                {
+                    reading[i].length += count;
+                    reading[i].deadline = now + REQUEST_TIMEOUT_MS;
+                    error = reading[i].length == MAX_REQUEST_BYTES ? "error the request is too large\n" : NULL;
+                }
+                else if (count == 0)
+                {
+                    complete = 1;
+                    error = NULL;
+                }
+                else
+                {
+                    error = "error the request can't be read\n";
+                }
             }
-        
-        }
-    result -> color_image = r_color;
-  }
-  
-  result -> width = img -> width;
-  result -> height = img -> height;
-  result -> max_val = img -> max_val;
-  result -> type = img -> type;
 
-  if (img -> type == PGM)
-  {
-        for (int i = start_line; i < end_line; i++) 
-        {
-            for (int j = 0; j < img -> width; j++)
-            {
-               float result_pixel_value = 0.0;
-               
-               for (int offset_i = -1; offset_i <= 1; offset_i++)
-               {
-                   for(int offset_j = -1; offset_j <= 1; offset_j++)
-                   {
-                       if (i + offset_i < 0 || i + offset_i == img -> height ||
-                           j + offset_j < 0 || j + offset_j == img -> width)
-                        {
-                            result_pixel_value += 0.0;
-                        }
-                       else
-                        {
-                            float image_pixel = (float) img -> image[i + offset_i][j + offset_j];
-                            float filter_associated_value = current_filter.values[1 - offset_i][1 - offset_j];
-                            result_pixel_value += (filter_associated_value * image_pixel);  
-                        }
-                   }
+            if (complete || error != NULL)
+            {
+                if (complete)
+                {
+                    queue_request(queue, &reading[i]);
+                }
+                else
+                {
+                    refuse_request(&reading[i], error);
                 }
+                reading[i] = reading[--number_of_reading];
+                events[i + 2] = events[number_of_reading + 2];
+            }
+        }
+
+        if (events[0].revents & POLLIN)
+        {
+            int connection = accept(queue -> listener, NULL, NULL);
+            if (connection < 0)
+            {
+                continue;
+            }
 
-                if (result_pixel_value > 255)  result_pixel_value = 255;
-                if (result_pixel_value < 0)  result_pixel_value = 0;
-               
-                result -> image[i][j] = (unsigned char) result_pixel_value;
-            }   
+            if (number_of_reading == capacity)
+            {
+                capacity *= 2;
+                reading = (open_request *) realloc(reading, capacity * sizeof(open_request));
+                events = (struct pollfd *) realloc(events, (capacity + 2) * sizeof(struct pollfd));
+            }
+            reading[number_of_reading].connection = connection;
+            reading[number_of_reading].text = (char *) malloc(MAX_REQUEST_BYTES + 1);
+            reading[number_of_reading].length = 0;
+            reading[number_of_reading].deadline = now + REQUEST_TIMEOUT_MS;
+            number_of_reading++;
         }
+    }
 
-        return result;
-  } 
-  else 
-  {
-      for (int i = start_line; i < end_line; i++) 
-        {
-            for (int j = 0; j < img -> width; j++)
-            {
-               float result_pixel_red = 0.0;
-               float result_pixel_green = 0.0;
-               float result_pixel_blue = 0.0;
-               
-               for (int offset_i = -1; offset_i <= 1; offset_i++)
-               {
-                   for(int offset_j = -1; offset_j <= 1; offset_j++)
-                   {
-                       if (i + offset_i == -1 || i + offset_i == img -> height ||
-                           j + offset_j == -1 || j + offset_j == img -> width)
-                        {
-                            result_pixel_red += 0.0;
-                            result_pixel_green += 0.0;
-                            result_pixel_blue += 0.0;
-                        }
-                       else
-                        {   
-                            pixel p = img -> color_image[i + offset_i][j + offset_j];
-                            float image_pixel_red = (float) p.red;
-                            float image_pixel_green = (float) p.green;
-                            float image_pixel_blue = (float) p.blue;
-
-                            float filter_associated_value = current_filter.values[1 - offset_i][1 - offset_j];
-                            result_pixel_red += (image_pixel_red * filter_associated_value);
-                            result_pixel_green += (image_pixel_green * filter_associated_value);
-                            result_pixel_blue += (image_pixel_blue * filter_associated_value);
-
-                        }
-                   }
-                }
-                if (result_pixel_red > 255) result_pixel_red = 255;
-                if (result_pixel_red < 0) result_pixel_red = 0;
-                if (result_pixel_green > 255) result_pixel_green = 255;
-                if (result_pixel_green < 0) result_pixel_green = 0;
-                if (result_pixel_blue > 255) result_pixel_blue = 255;
-                if (result_pixel_blue < 0) result_pixel_blue = 0;       
-                pixel result_pixel = 
-                {
-                    (unsigned char) result_pixel_red,
-                    (unsigned char) result_pixel_green,
-                    (unsigned char) result_pixel_blue
-                };
-                result->color_image[i][j] = result_pixel;
-           
-            }   
-        }
-        
-        return result;
-  }
+    for (int i = 0; i < number_of_reading; i++)
+    {
+        refuse_request(&reading[i], "error the service has been shut down\n");
+    }
+    free(reading);
+    free(events);
+    return NULL;
 }
 
 /****************************************************************************************************/
 
 /**
- * Main entry of the process that handles the image distribution 
- * and the data gathering from all the slave processes.
+ *  @param: options
  * 
- * 
- **/ 
-
-int main(int argc, char *argv[]) {
+ *  Run the service until a shutdown request, on all the processes. The master
+ *  broadcasts every batch of requests as a manifest, and a negative length to
+ *  stop the other processes.
+ **/
+void run_service(run_options *options)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-  int rank;
-  int number_of_processes;
+    service_queue queue;
+    pthread_t acceptor;
+    if (rank == MASTER)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, options -> socket_path, sizeof(address.sun_path) - 1);
+        unlink(options -> socket_path);
 
-  MPI_Init(&argc, &argv);
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &number_of_processes);
+        queue.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (queue.listener < 0 || bind(queue.listener, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+            listen(queue.listener, SOMAXCONN) < 0 || pipe(queue.wakeup) < 0)
+        {
+            printf("The socket %s can't be opened!\n", options -> socket_path);
+            exit(1);
+        }
 
-  if (rank == MASTER) 
-  {
-    int start_line;
-    int end_line;
+        pthread_mutex_init(&queue.lock, NULL);
+        pthread_cond_init(&queue.ready, NULL);
+        queue.capacity = 16;
+        queue.number_of_requests = 0;
+        queue.requests = (service_request *) malloc(queue.capacity * sizeof(service_request));
+        pthread_create(&acceptor, NULL, accept_worker, &queue);
 
-    if (argc < 4) 
-    {
-      printf("\n\t Please provide at least 3 arguments for the executable: \n\t mpirun -np P ./executable image_in image_out filter_1 filter_2 ...\n Although the executable stop working the lamboot background daemon will continue to work \n\t please end it with Ctrl + C\n");
-      exit(-1);
+        printf("Serving on %s\n", options -> socket_path);
+        fflush(stdout);
     }
 
-    Image *image = read_image(argv[1]);
-    Image *out = read_image(argv[1]);
-    
-    for (int i = 3; i < argc; i++) 
-    {
-       
-        int division_ratio = (int)ceil((1.0 * image -> height) / number_of_processes);
-        int low_bound = division_ratio * rank;
-        int high_bound= (int)fmin(division_ratio * (rank + 1), image -> height);
-        
-        int start_line_master = low_bound;
-        int end_line_master = high_bound;
-
-        if (number_of_processes == 1)
-        {
-            end_line_master = image -> height;
-        }
-        
-         /**
-         *  Copy the content of the current image received from read_image funstion
-         *  into the out image receiver buffer wich will be the working one during 
-         *  filtering process.
-         * 
-         **/ 
+    int stopping = 0;
+    while (1)
+    {
+        service_request *batch = NULL;
+        int number_of_requests = 0;
+        char *manifest = NULL;
+        long long length = -1;
 
-        if (image -> type == PGM)
+        if (rank == MASTER && !stopping)
         {
-            for ( int i = 0; i < image -> height; i++)
+            pthread_mutex_lock(&queue.lock);
+            while (queue.number_of_requests == 0)
             {
-                for (int j = 0; j < image -> width; j++)
-                {
-                    image -> image[i][j] = out -> image[i][j];
-                }
-            
+                pthread_cond_wait(&queue.ready, &queue.lock);
             }
-        }
-        else
-        {
-            for ( int i = 0; i < image -> height; i++)
+            number_of_requests = queue.number_of_requests;
+            batch = (service_request *) malloc(number_of_requests * sizeof(service_request));
+            memcpy(batch, queue.requests, number_of_requests * sizeof(service_request));
+            queue.number_of_requests = 0;
+            pthread_mutex_unlock(&queue.lock);
+
+            /**
+             *  All the queued requests are joined in a single manifest
+             **/ 
+            length = 0;
+            for (int i = 0; i < number_of_requests; i++)
+            {
+                length += strlen(batch[i].text) + 1;
+            }
+            manifest = (char *) malloc(length + 1);
+            manifest[0] = '\0';
+            for (int i = 0; i < number_of_requests; i++)
             {
-                for (int j = 0; j < image -> width; j++)
+                char *text = batch[i].text;
+                if (is_shutdown_request(text))
                 {
-                    image -> color_image[i][j] = out -> color_image[i][j];
+                    stopping = 1;
+                    text = "";
                 }
-            
+                strcat(manifest, text);
+                strcat(manifest, "\n");
             }
+            length = strlen(manifest);
         }
-        
 
-        for (int i = 1; i < number_of_processes; i++) 
+        char *text = broadcast_text(manifest, length);
+        if (text == NULL)
         {
-            start_line = 0;
-            end_line = image->height;
-            send_image(image, i, start_line, end_line);
+            break;
         }
 
-        out = apply_filter(image, get_filter_by_name(argv[i]), start_line_master, end_line_master);
-    
-        for (int i = 1; i < number_of_processes; i++) 
-        {
-            int division_ratio_i = (int)ceil((1.0 * image -> height) / number_of_processes);
-            int low_bound_i = division_ratio_i * i;
-            int high_bound_i = (int)fmin(division_ratio_i * (i + 1), image -> height);
-
-            start_line = low_bound_i;
-            end_line = high_bound_i;
-            
-            Image *img = receive_image(i);
+        double start_time = MPI_Wtime();
+        int number_of_entries;
+        batch_entry *entries = parse_manifest(text, &number_of_entries);
+        process_entries(entries, number_of_entries, options);
+        free_entries(entries, number_of_entries);
+        free(text);
 
-            for (int j = start_line; j < end_line; j++) 
+        if (rank == MASTER)
+        {
+            double seconds = MPI_Wtime() - start_time;
+            for (int i = 0; i < number_of_requests; i++)
             {
-                if (img -> type == PGM)
-                {
-                    out->image[j] = img->image[j];
-                }
-                else
+                char message[64];
+                int count = 0;
+                char *line_context;
+                for (char *line = strtok_r(batch[i].text, "\n", &line_context); line != NULL; 
+                     line = strtok_r(NULL, "\n", &line_context))
                 {
-                    out->color_image[j] = img->color_image[j];
+                    int words = 0;
+                    char *context;
+                    for (char *word = strtok_r(line, " \t\r", &context); word != NULL && (words > 0 || word[0] != '#');
+                         word = strtok_r(NULL, " \t\r", &context))
+                    {
+                        words++;
+                    }
+                    count += words >= 3;
                 }
+                snprintf(message, sizeof(message), "ok %d %.6f\n", count, seconds);
+                answer_request(batch[i].connection, message);
+                free(batch[i].text);
             }
+            free(batch);
+            free(manifest);
         }
     }
 
-    write_image(out, argv[2]);
-    for (int i = 0; i < image -> height; i++)
+    /**
+     *  The acceptor is woken up and joined before the queue goes out of scope
+     **/ 
+    if (rank == MASTER)
     {
-        if (image -> type == PGM)
+        char stop = 1;
+        if (write(queue.wakeup[1], &stop, 1) != 1)
         {
-            free(image -> image[i]);
+            printf("The service can't be stopped!\n");
+            exit(1);
         }
-        else
+        pthread_join(acceptor, NULL);
+
+        close(queue.listener);
+        close(queue.wakeup[0]);
+        close(queue.wakeup[1]);
+        unlink(options -> socket_path);
+
+        for (int i = 0; i < queue.number_of_requests; i++)
         {
-            free(image -> color_image[i]);
-        }  
-        
+            answer_request(queue.requests[i].connection, "error the service has been shut down\n");
+            free(queue.requests[i].text);
+        }
+        free(queue.requests);
+        pthread_mutex_destroy(&queue.lock);
+        pthread_cond_destroy(&queue.ready);
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ * Main entry of the process that handles the image distribution 
+ * and the data gathering from all the slave processes.
+ * 
+ * The lines are filtered either in fixed strips (filter_strips) or in chunks
+ * handed out on demand (--dynamic); in both cases the master writes the 
+ * result once, at the end. With --batch the same processes handle all the
+ * images of a manifest.
+ **/ 
+
+int main(int argc, char *argv[]) {
+
+  int rank;
+
+  /**
+   *  Only the main thread of a process calls MPI; the other threads only filter
+   *  or, in batch mode, read and write the images.
+   **/ 
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  /**
+   *  The options come before the images: --threads T sets the number of 
+   *  threads that filter the strip of every process, --dynamic hands out the
+   *  lines to the processes on demand instead of in fixed strips, --shared
+   *  gives the fixed strips to the nodes, in memory shared by their processes,
+   *  --blocks splits the image in a 2-D grid of blocks instead of strips,
+   *  --compress compresses the lines sent between the processes, --mpiio
+   *  makes every process read and write its own lines of the images, 
+   *  --stream S filters the image in strips of S lines read and written one
+   *  by one, --time prints the time spent to filter the image (from the 
+   *  distribution of the image to its gathering), --profile prints the time
+   *  of every phase and the MPI traffic of every process, --roi x,y,w,h 
+   *  filters and writes only a rectangle of the image, --incremental 
+   *  previous_in previous_out [--dirty x,y,w,h ...] filters again only the 
+   *  changed rectangles, --batch manifest processes all the images of the
+   *  manifest and --serve socket keeps the processes up to filter the images
+   *  requested on a UNIX socket.
+   **/ 
+  run_options options = {1, 0, 0, 0, 0, NULL, 0, 0};
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
+  {
+    if (strcmp(argv[1], "--threads") == 0 && argc > 2 && atoi(argv[2]) > 0)
+    {
+      options.number_of_threads = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    else if (strcmp(argv[1], "--dynamic") == 0)
+    {
+      options.dynamic = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--mpiio") == 0)
+    {
+      options.mpiio = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--stream") == 0 && argc > 2 && atoi(argv[2]) > 0)
+    {
+      options.stream_lines = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    else if (strcmp(argv[1], "--time") == 0)
+    {
+      options.timing = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--shared") == 0)
+    {
+      options.shared = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--blocks") == 0)
+    {
+      options.blocks = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--roi") == 0 && argc > 2 && parse_rectangle(argv[2], &options.region))
+    {
+      options.has_region = 1;
+      argc -= 2;
+      argv += 2;
+    }
+    else if (strcmp(argv[1], "--incremental") == 0 && argc > 3)
+    {
+      options.previous_input = argv[2];
+      options.previous_output = argv[3];
+      argc -= 3;
+      argv += 3;
     }
-    for (int i = 0; i < image -> height; i++)
+    else if (strcmp(argv[1], "--dirty") == 0 && argc > 2)
     {
-        if (image -> type == PGM)
+      options.dirty = (rectangle *) realloc(options.dirty, (options.number_of_dirty + 1) * sizeof(rectangle));
+      if (!parse_rectangle(argv[2], &options.dirty[options.number_of_dirty]))
+      {
+        if (rank == MASTER)
         {
-            free(out -> image[i]);
+          printf("\n\t Invalid rectangle: %s\n", argv[2]);
         }
-        else
-        {
-            free(out -> color_image[i]);
-        }  
-        
+        MPI_Finalize();
+        exit(-1);
+      }
+      options.number_of_dirty++;
+      argc -= 2;
+      argv += 2;
+    }
+    else if (strcmp(argv[1], "--compress") == 0)
+    {
+      options.compress = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--profile") == 0)
+    {
+      options.profiling = 1;
+      argc -= 1;
+      argv += 1;
+    }
+    else if (strcmp(argv[1], "--serve") == 0 && argc > 2)
+    {
+      options.socket_path = argv[2];
+      argc -= 2;
+      argv += 2;
+    }
+    else if (strcmp(argv[1], "--batch") == 0 && argc > 2)
+    {
+      options.manifest = argv[2];
+      argc -= 2;
+      argv += 2;
+    }
+    else
+    {
+      if (rank == MASTER)
+      {
+        printf("\n\t Unknown or invalid option: %s\n", argv[1]);
+      }
+      MPI_Finalize();
+      exit(-1);
     }
+  }
 
-    free(image);
-    free(out);
+  profiling.enabled = options.profiling;
+  transport.enabled = options.compress;
 
-  } else {
-    
-    Image *img;
-    Image *out_slave;
-    
-    for (int i = 3; i < argc; i++) 
-    {
-      img = receive_image(MASTER);
-      
-      int divion_ratio = (int)ceil((1.0 * img -> height) / number_of_processes);
-      int low_bound = divion_ratio * rank;
-      int high_bound= (int)fmin(divion_ratio * (rank + 1), img -> height);
-
-      int start_line_slave = low_bound;
-      int end_line_slave = high_bound;
-      
-      if (rank == number_of_processes - 1)
+  if ((options.has_region || options.previous_output != NULL) && 
+      (options.mpiio || options.stream_lines > 0 || options.manifest != NULL || options.socket_path != NULL))
+  {
+    if (rank == MASTER)
+    {
+      printf("\n\t --roi and --incremental can not be used with --mpiio, --stream, --batch or --serve\n");
+    }
+    MPI_Finalize();
+    exit(-1);
+  }
+
+  /**
+   *  Without MPI_THREAD_FUNNELED no other thread may exist besides the one that
+   *  calls MPI: the strips are filtered by one thread, and the batch and the
+   *  service modes (which read, write and accept in their own threads) are refused.
+   **/ 
+  if (provided < MPI_THREAD_FUNNELED)
+  {
+    if (options.manifest != NULL || options.socket_path != NULL)
+    {
+      if (rank == MASTER)
       {
-          end_line_slave = img -> height;
+        printf("\n\t --batch and --serve need an MPI library with MPI_THREAD_FUNNELED\n");
       }
+      MPI_Finalize();
+      exit(-1);
+    }
+    if (options.number_of_threads > 1 && rank == MASTER)
+    {
+      printf("\n\t The MPI library does not support MPI_THREAD_FUNNELED: --threads is ignored\n");
+    }
+    options.number_of_threads = 1;
+  }
 
-      out_slave = apply_filter(img, get_filter_by_name(argv[i]), start_line_slave, end_line_slave);
-      send_image(out_slave, 0, 0, img -> height);
+  if (options.socket_path != NULL)
+  {
+    run_service(&options);
+    if (options.compress)
+    {
+      print_compression();
+    }
+    if (options.profiling)
+    {
+      print_profile();
     }
+    MPI_Finalize();
+    return 0;
+  }
 
-     for (int i = 0; i < img -> height; i++)
+  if (options.manifest != NULL)
+  {
+    run_batch(&options);
+    if (options.compress)
     {
-        if (img -> type == PGM)
-        {
-            free(img -> image[i]);
-        }
-        else
-        {
-            free(img -> color_image[i]);
-        }  
-        
+      print_compression();
+    }
+    if (options.profiling)
+    {
+      print_profile();
+    }
+    MPI_Finalize();
+    return 0;
+  }
+
+  if (argc < 4) 
+  {
+    if (rank == MASTER)
+    {
+      printf("\n\t Please provide at least 3 arguments for the executable: \n\t mpirun -np P ./executable [--threads T] [--dynamic] [--shared] [--blocks] [--compress] [--mpiio] [--stream S] [--time] [--profile]\n\t [--roi x,y,w,h] [--incremental previous_in previous_out [--dirty x,y,w,h ...]] image_in image_out filter_1 filter_2 ...\n"
+             "\t or a manifest of images: \n\t mpirun -np P ./executable [options] --batch manifest\n"
+             "\t or a service on a UNIX socket: \n\t mpirun -np P ./executable [options] --serve socket\n");
     }
+    MPI_Finalize();
+    exit(-1);
+  }
+
+  Image *image = NULL;
+  parallel_files files;
+  parallel_files *io = NULL;
 
-    for (int i = 0; i < out_slave -> height; i++)
+  /**
+   *  Only the header of the image is broadcasted: type, width, height, max_val
+   **/ 
+  int header[4];
+
+  double start_time = profile_clock();
+  if (options.mpiio || options.stream_lines > 0)
+  {
+    open_parallel_files(argv[1], argv[2], header, &files);
+    io = &files;
+  }
+  else
+  {
+    if (rank == MASTER)
     {
-        if (out_slave -> type == PGM)
-        {
-            free(out_slave -> image[i]);
-        }
-        else
-        {
-            free(out_slave -> color_image[i]);
-        }  
-        
+      image = read_image(argv[1]);
+      header[0] = image -> type;
+      header[1] = image -> width;
+      header[2] = image -> height;
+      header[3] = image -> max_val;
     }
-    
-    free(img);
-    free(out_slave);
+    MPI_Bcast(header, 4, MPI_INT, MASTER, MPI_COMM_WORLD);
+  }
+  profile_phase(PHASE_READ, start_time);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  start_time = MPI_Wtime();
+
+  if (options.has_region)
+  {
+    rectangle area = grow_rectangle(options.region, 0, header[1], header[2]);
+    if (area.width <= 0 || area.height <= 0)
+    {
+      if (rank == MASTER)
+      {
+        printf("\n\t The region is outside the image\n");
+      }
+      MPI_Finalize();
+      exit(-1);
+    }
+
+    Image *result = filter_region(image, header, area, argv + 3, argc - 3, get_chain_radius(argv + 3, argc - 3), &options);
+    if (rank == MASTER)
+    {
+      free_image(image);
+    }
+    image = result;
+  }
+  else if (options.previous_output != NULL)
+  {
+    image = filter_incremental(image, header, argv + 3, argc - 3, &options);
+  }
+  else
+  {
+    image = filter_image(image, header, argv + 3, argc - 3, &options, io);
+  }
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (options.timing && rank == MASTER)
+  {
+    printf("filter time: %.6f s\n", MPI_Wtime() - start_time);
+  }
+
+  start_time = profile_clock();
+  if (io != NULL)
+  {
+    close_parallel_files(io);
+    if (rank == MASTER)
+    {
+      printf("\t\nThe result image has been writen in the current folder: %s\n", argv[2]);
+    }
+  }
+  else if (rank == MASTER)
+  {
+    write_image(image, argv[2]);
+    free_image(image);
+  }
+  profile_phase(PHASE_WRITE, start_time);
 
+  if (options.compress)
+  {
+    print_compression();
+  }
+  if (options.profiling)
+  {
+    print_profile();
   }
   
   MPI_Finalize();
@@ -742,4 +7158,4 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-/****************************************************************************************************/
\ No newline at end of file
+/****************************************************************************************************/
@@ -1,21 +1,34 @@
 #include <stdio.h>
-#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /**
- *  Type definitions
- * 
- **/ 
-typedef struct 
-{
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
+ *  Comparator of images: every pair of images given in the command line is
+ *  compared in full, in parallel, and the differences are reported.
+ *
+ *  ./compare [--tolerance T] [--threads N] image_1 reference_1 [image_2 reference_2 ...]
+ *
+ *  The exit code is 0 only if all the pairs match (no byte differs by more
+ *  than T), so it can be used by the regression checks of the Makefile.
+ **/
 
-} pixel;
+#define PGM 5
+#define PNM 6
 
+/**
+ *  Type definitions
+ *
+ **/
 typedef struct
 {
     int height;
@@ -23,198 +36,451 @@ typedef struct
     int max_val;
     int type;
     /**
-     *  For PGM images
-     **/ 
-    unsigned char **image;
-    /**
-     *  For PNM images
-     **/ 
-    pixel **color_image;
+     *  The pixels, in place in the mapping of the file
+     **/
+    unsigned char *content;
+    unsigned char *mapping;
+    size_t mapping_size;
 
 } Image;
 
+/**
+ *  The differences found in a block of lines, or in the whole image
+ **/
+typedef struct
+{
+    long long histogram[256];
+    long long differing_pixels;
+    double squared_error;
+    int max_diff;
+    int min_line;
+    int max_line;
+    int min_column;
+    int max_column;
+
+} statistics;
+
+typedef struct
+{
+    Image *first;
+    Image *second;
+    int start_line;
+    int end_line;
+    int tolerance;
+    statistics result;
+
+} compare_task;
+
+/****************************************************************************************************/
+
+/**
+ * @param: data
+ * @param: size
+ * @param: position
+ *
+ * Read a field of the netpbm header, skipping the white spaces and the
+ * comments before it; returns -1 if there is no valid number.
+ **/
+int read_header_number(const unsigned char *data, size_t size, size_t *position)
+{
+    while (*position < size)
+    {
+        if (data[*position] == '#')
+        {
+            while (*position < size && data[*position] != '\n')
+            {
+                (*position)++;
+            }
+        }
+        else if (data[*position] == ' ' || data[*position] == '\t' || data[*position] == '\n' ||
+                 data[*position] == '\r' || data[*position] == '\v' || data[*position] == '\f')
+        {
+            (*position)++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    long long value = -1;
+    while (*position < size && data[*position] >= '0' && data[*position] <= '9')
+    {
+        value = (value < 0 ? 0 : value) * 10 + (data[*position] - '0');
+        if (value > 0x7fffffff)
+        {
+            return -1;
+        }
+        (*position)++;
+    }
+
+    return (int) value;
+}
+
+/****************************************************************************************************/
+
 /**
  * @param: image_file_name
- * Function that reads the content of the image and aditional 
- * data from the indicated filename.
- * 
- **/ 
+ *
+ * Map an image in memory; returns NULL (with a message) if it can't be used.
+ **/
 Image *read_image(char *image_file_name)
 {
-    FILE *fin = fopen(image_file_name, "rb");
-    
-    if(fin == NULL)
+    int fd = open(image_file_name, O_RDONLY);
+    struct stat file_status;
+
+    if (fd < 0 || fstat(fd, &file_status) < 0)
     {
-        printf("The file can't be opened!\n");
-        exit(1);
+        printf("%s: the file can't be opened!\n", image_file_name);
+        return NULL;
     }
 
-    Image *image = (Image *) malloc (sizeof(Image));
-    unsigned char image_type[3];
-    unsigned char comment[45];
-    int width;
-    int height;
-    int max_val;
-    fscanf(fin, "%s\n", image_type);
-    if (strcmp(image_type, "P5") == 0)
+    size_t size = file_status.st_size;
+    unsigned char *data = (unsigned char *) mmap(NULL, size > 0 ? size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
     {
-        image -> type = 5;
-    } 
-    else
+        printf("%s: the file can't be mapped!\n", image_file_name);
+        return NULL;
+    }
+
+    Image *image = (Image *) malloc(sizeof(Image));
+    image -> mapping = data;
+    image -> mapping_size = size > 0 ? size : 1;
+
+    size_t position = 2;
+    if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
     {
-        image -> type = 6;
+        printf("%s: not a P5 or P6 netpbm image!\n", image_file_name);
+        munmap(data, image -> mapping_size);
+        free(image);
+        return NULL;
     }
-   // fscanf(fin, "%[^\n]%*c", comment);
-    fscanf(fin, "%d %d\n", &width, &height);
-    fscanf(fin, "%d\n", &max_val);
-    image -> width = width;
-    image -> height = height;
-    image -> max_val = max_val;
-    if (image -> type == 5)
+
+    image -> type = data[1] == '5' ? PGM : PNM;
+    image -> width = read_header_number(data, size, &position);
+    image -> height = read_header_number(data, size, &position);
+    image -> max_val = read_header_number(data, size, &position);
+    int separated = position < size && (data[position] == ' ' || data[position] == '\t' || 
+                                         data[position] == '\r' || data[position] == '\n');
+    position++;
+
+    size_t line_bytes = (size_t) (image -> type == PGM ? 1 : 3) * image -> width;
+    if (image -> width <= 0 || image -> height <= 0 || image -> max_val <= 0 || image -> max_val > 255 ||
+        !separated || position > size || size - position < line_bytes * image -> height)
     {
-        /**
-         *  Read black - white pixels
-         **/ 
-        unsigned char **pgm_content = (unsigned char **) malloc (image -> height * sizeof(unsigned char *));
-        for (int line = 0; line < image -> height; ++line)
+        printf("%s: invalid or truncated image!\n", image_file_name);
+        munmap(data, image -> mapping_size);
+        free(image);
+        return NULL;
+    }
+
+    image -> content = data + position;
+    return image;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: image
+ **/
+void free_image(Image *image)
+{
+    munmap(image -> mapping, image -> mapping_size);
+    free(image);
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: task
+ * @param: first
+ * @param: second
+ * @param: line
+ * @param: from
+ * @param: to
+ *
+ * Account the bytes [from, to) of a line, at least one of them being different.
+ **/
+void account_bytes(compare_task *task, const unsigned char *first, const unsigned char *second, int line, int from, int to)
+{
+    int channels = task -> first -> type == PGM ? 1 : 3;
+    statistics *result = &task -> result;
+
+    for (int position = from; position < to; position++)
+    {
+        int diff = abs(first[position] - second[position]);
+        result -> histogram[diff]++;
+        result -> squared_error += (double) diff * diff;
+        if (diff > result -> max_diff)
         {
-            pgm_content[line] = (unsigned char *) malloc(image -> width * sizeof(unsigned char));
+            result -> max_diff = diff;
         }
-        for (int line  = 0; line < image -> height; ++line)
+
+        /**
+         *  A pixel is counted once, at its first channel over the tolerance
+         **/
+        int column = position / channels;
+        if (diff > task -> tolerance)
         {
-            fread(pgm_content[line], sizeof(unsigned char), image -> width, fin);
+            int first_channel = column * channels;
+            int counted = 0;
+            for (int channel = first_channel; channel < position; channel++)
+            {
+                if (abs(first[channel] - second[channel]) > task -> tolerance)
+                {
+                    counted = 1;
+                }
+            }
+
+            if (!counted)
+            {
+                result -> differing_pixels++;
+                if (line < result -> min_line) result -> min_line = line;
+                if (line > result -> max_line) result -> max_line = line;
+                if (column < result -> min_column) result -> min_column = column;
+                if (column > result -> max_column) result -> max_column = column;
+            }
         }
-        image -> image = pgm_content;
-    } 
-    else 
+    }
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: argument -> a compare_task
+ *
+ * Compare the lines of a task. Blocks of 16 bytes are compared with SSE2 and
+ * only the blocks with a difference are looked at byte by byte, so equal
+ * images are compared at the speed of the memory.
+ **/
+void *compare_worker(void *argument)
+{
+    compare_task *task = (compare_task *) argument;
+    int line_bytes = (task -> first -> type == PGM ? 1 : 3) * task -> first -> width;
+
+    for (int line = task -> start_line; line < task -> end_line; line++)
     {
-        /**
-         *  Read RGB pixels
-         **/ 
-        pixel **pnm_content = (pixel **) malloc (image -> height * sizeof(pixel *));
-        for (int line = 0; line < image -> height; ++line)
+        const unsigned char *first = task -> first -> content + (size_t) line * line_bytes;
+        const unsigned char *second = task -> second -> content + (size_t) line * line_bytes;
+        int position = 0;
+
+#if defined(__SSE2__)
+        for (; position + 16 <= line_bytes; position += 16)
         {
-            pnm_content[line] = (pixel *) malloc (image -> width * sizeof(pixel)); 
+            __m128i a = _mm_loadu_si128((const __m128i *) (first + position));
+            __m128i b = _mm_loadu_si128((const __m128i *) (second + position));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF)
+            {
+                account_bytes(task, first, second, line, position, position + 16);
+            }
         }
-        for (int line = 0; line < image -> height; ++line)
+#endif
+
+        for (; position < line_bytes; position++)
         {
-            fread(pnm_content[line], sizeof(pixel), image -> width, fin);
+            if (first[position] != second[position])
+            {
+                account_bytes(task, first, second, line, position, position + 1);
+            }
         }
-        image -> color_image = pnm_content;
-    
     }
 
-    fclose(fin);
-    return image;
+    return NULL;
 }
 
+/****************************************************************************************************/
+
 /**
- * @param: image
- * @param: output_file_name
- * Write the image in the file specified by name;
- * 
- **/ 
-void write_image(Image *image, char *output_file_name)
+ * @param: result
+ **/
+void clear_statistics(statistics *result)
 {
-    FILE *fout = fopen(output_file_name, "wb");
-    if (fout == NULL)
-    {
-        printf("The file can't be opened!\n");
-        exit(1);
-    }
-    unsigned char *image_type;
-    unsigned char width[5];
-    unsigned char height[5];
-    unsigned char max_val[5];
-    unsigned char delimiter = ' ';
-    unsigned char separator = '\n';
-    sprintf(width, "%d", image -> width);
-    sprintf(height, "%d", image -> height);
-    sprintf(max_val, "%d", image -> max_val);
-
-    if (image -> type == 5)
-    {
-        image_type = "P5\n";
-    } 
-    else
+    memset(result, 0, sizeof(statistics));
+    result -> min_line = 0x7fffffff;
+    result -> min_column = 0x7fffffff;
+    result -> max_line = -1;
+    result -> max_column = -1;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: first
+ * @param: second
+ * @param: tolerance
+ * @param: number_of_threads
+ * @param: total -> the differences of the two images
+ *
+ * Compare two images of the same size with number_of_threads threads, each
+ * of them on a block of lines.
+ **/
+void compare_images(Image *first, Image *second, int tolerance, int number_of_threads, statistics *total)
+{
+    int number_of_blocks = number_of_threads < first -> height ? number_of_threads : first -> height;
+    pthread_t threads[number_of_blocks];
+    compare_task tasks[number_of_blocks];
+
+    for (int t = 0; t < number_of_blocks; t++)
     {
-        image_type = "P6\n";
+        tasks[t].first = first;
+        tasks[t].second = second;
+        tasks[t].start_line = (int) ((long long) first -> height * t / number_of_blocks);
+        tasks[t].end_line = (int) ((long long) first -> height * (t + 1) / number_of_blocks);
+        tasks[t].tolerance = tolerance;
+        clear_statistics(&tasks[t].result);
+        pthread_create(&threads[t], NULL, compare_worker, &tasks[t]);
     }
-    
-    fwrite(image_type, sizeof(unsigned char), strlen(image_type), fout);
-    fwrite(width, sizeof(unsigned char), strlen(width), fout);
-    fwrite(&delimiter, sizeof(unsigned char), 1, fout);
-    fwrite(height, sizeof(unsigned char), strlen(height), fout);
-    fwrite(&separator, sizeof(unsigned char), 1, fout);
-    fwrite(max_val, sizeof(unsigned char), strlen(max_val), fout);
-    fwrite(&separator, sizeof(unsigned char), 1, fout);
-    if (image -> type == 5)
+
+    /**
+     *  The equal bytes are not counted by the workers
+     **/
+    clear_statistics(total);
+    long long bytes = (long long) (first -> type == PGM ? 1 : 3) * first -> width * first -> height;
+    long long different_bytes = 0;
+
+    for (int t = 0; t < number_of_blocks; t++)
     {
-        for (int line = 0; line < image -> height; ++line)
+        pthread_join(threads[t], NULL);
+        statistics *result = &tasks[t].result;
+
+        for (int diff = 1; diff < 256; diff++)
         {
-            fwrite(image -> image[line], sizeof(unsigned char), image -> width, fout);
+            total -> histogram[diff] += result -> histogram[diff];
+            different_bytes += result -> histogram[diff];
         }
-    } 
+        total -> differing_pixels += result -> differing_pixels;
+        total -> squared_error += result -> squared_error;
+        if (result -> max_diff > total -> max_diff) total -> max_diff = result -> max_diff;
+        if (result -> min_line < total -> min_line) total -> min_line = result -> min_line;
+        if (result -> max_line > total -> max_line) total -> max_line = result -> max_line;
+        if (result -> min_column < total -> min_column) total -> min_column = result -> min_column;
+        if (result -> max_column > total -> max_column) total -> max_column = result -> max_column;
+    }
+
+    total -> histogram[0] = bytes - different_bytes;
+}
+
+/****************************************************************************************************/
+
+/**
+ * @param: first_name
+ * @param: second_name
+ * @param: tolerance
+ * @param: number_of_threads
+ *
+ * Compare two image files and print the report; returns 1 if they match.
+ **/
+int compare_files(char *first_name, char *second_name, int tolerance, int number_of_threads)
+{
+    Image *first = read_image(first_name);
+    Image *second = read_image(second_name);
+    int match = 0;
+
+    if (first == NULL || second == NULL)
+    {
+        printf("%s vs %s: FAILED, the images can't be compared\n", first_name, second_name);
+    }
+    else if (first -> type != second -> type || first -> width != second -> width || first -> height != second -> height)
+    {
+        printf("%s vs %s: FAILED, different types or sizes (P%d %dx%d vs P%d %dx%d)\n", first_name, second_name,
+               first -> type, first -> width, first -> height, second -> type, second -> width, second -> height);
+    }
     else
     {
-         for (int line = 0; line < image -> height; ++line)
-         {
-            fwrite(image -> color_image[line], sizeof(pixel), image -> width, fout);
-         }
+        statistics total;
+        compare_images(first, second, tolerance, number_of_threads, &total);
+
+        long long pixels = (long long) first -> width * first -> height;
+        long long bytes = (long long) (first -> type == PGM ? 1 : 3) * pixels;
+        match = total.differing_pixels == 0;
+
+        if (total.max_diff == 0)
+        {
+            printf("%s vs %s: identical\n", first_name, second_name);
+        }
+        else
+        {
+            double mse = total.squared_error / bytes;
+            printf("%s vs %s: %s, %lld pixels differ by more than %d (%.4f%%), max diff %d, PSNR %.2f dB",
+                   first_name, second_name, match ? "ok" : "FAILED", total.differing_pixels, tolerance,
+                   100.0 * total.differing_pixels / pixels, total.max_diff,
+                   10.0 * log10((double) first -> max_val * first -> max_val / mse));
+            if (total.differing_pixels > 0)
+            {
+                printf(", lines %d - %d, columns %d - %d", total.min_line, total.max_line, total.min_column, total.max_column);
+            }
+            printf("\n\t histogram of the byte differences:");
+            for (int diff = 0; diff < 256; diff++)
+            {
+                if (total.histogram[diff] > 0)
+                {
+                    printf(" %d: %lld", diff, total.histogram[diff]);
+                }
+            }
+            printf("\n");
+        }
+    }
+
+    if (first != NULL)
+    {
+        free_image(first);
     }
-    
-    fclose(fout);
-    printf("\t\nThe result image has been writen in the current folder: %s\n", output_file_name);
+    if (second != NULL)
+    {
+        free_image(second);
+    }
+
+    return match;
 }
 
+/****************************************************************************************************/
+
 /**
  *  Main entry of the program
- * 
- * 
- **/ 
+ *
+ *
+ **/
 int main(int argc, char *argv[])
 {
-    Image *before = read_image(argv[3]);
-    Image *in = read_image(argv[1]);
-    Image *ref = read_image(argv[2]);
+    int tolerance = 0;
+    int number_of_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (number_of_threads < 1)
+    {
+        number_of_threads = 1;
+    }
 
-    for (int i = in -> height /4; i < (in -> height /4 ) + 3; i++)
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
     {
-        for (int j = in -> width / 2; j < (in -> width / 2) + 3; j++)
+        if (strcmp(argv[1], "--tolerance") == 0 && argc > 2 && atoi(argv[2]) >= 0)
+        {
+            tolerance = atoi(argv[2]);
+        }
+        else if (strcmp(argv[1], "--threads") == 0 && argc > 2 && atoi(argv[2]) > 0)
         {
-            printf("%u ", in -> image[i][j]);
+            number_of_threads = atoi(argv[2]);
         }
-        printf("\n");
+        else
+        {
+            printf("\n\t Unknown or invalid option: %s\n", argv[1]);
+            return 2;
+        }
+        argc -= 2;
+        argv += 2;
     }
 
-    
-     for (int i = in -> height / 4; i < (in -> height /4 ) + 3; i++)
+    if (argc < 3 || argc % 2 == 0)
     {
-        for (int j = in -> width / 2; j < (in -> width / 2) + 3; j++)
-        {
-            printf("%u ", ref -> image[i][j]);
-        }
-        printf("\n");
+        printf("\n\t Usage: ./compare [--tolerance T] [--threads N] image_1 reference_1 [image_2 reference_2 ...]\n");
+        return 2;
     }
 
-     for (int i = in -> height / 4; i < (in -> height /4 ) + 3; i++)
+    int failed = 0;
+    for (int i = 1; i < argc; i += 2)
     {
-        for (int j = in -> width / 2; j < (in -> width / 2) + 3; j++)
-        {
-            printf("%u ", before -> image[i][j]);
-        }
-        printf("\n");
-    }
-
-    // for (int i = 0; i < in -> height; i++)
-    // {
-    //     for (int j = 0; j < in -> width; j++)
-    //     {
-    //         if (in -> image[i][j] != ref -> image[i][j])
-    //         {
-    //             printf("In: %u Ref: %u\n\n", in -> image[i][j], ref -> image[i][j]);
-    //         }
-    //     }
-    // }
-    return 0;
+        failed += !compare_files(argv[i], argv[i + 1], tolerance, number_of_threads);
+    }
+
+    printf("%d of %d pairs match\n", (argc - 1) / 2 - failed, (argc - 1) / 2);
+    return failed > 0;
 }